@@ -88,6 +88,8 @@ void pci_free_dev(struct pci_dev *d)
 
   pci_free_caps(d);
   pci_free_properties(d);
+  pci_mfree(d->prefetch);
+  pci_mfree(d->vpd_cache);
   pci_mfree(d);
 }
 
@@ -98,6 +100,8 @@ pci_read_data(struct pci_dev *d, void *buf, int pos, int len)
     d->access->error("Unaligned read: pos=%02x, len=%d", pos, len);
   if (pos + len <= d->cache_len)
     memcpy(buf, d->cache + pos, len);
+  else if (pos + len <= d->prefetch_len)
+    memcpy(buf, d->prefetch + pos, len);
   else if (!d->methods->read(d, pos, buf, len))
     memset(buf, 0xff, len);
 }
@@ -129,13 +133,44 @@ pci_read_long(struct pci_dev *d, int pos)
 int
 pci_read_block(struct pci_dev *d, int pos, byte *buf, int len)
 {
+  if (pos >= 0 && pos < d->prefetch_len)
+    {
+      int l = (pos + len <= d->prefetch_len) ? len : (d->prefetch_len - pos);
+      memcpy(buf, d->prefetch + pos, l);
+      if (l == len)
+	return 1;
+      /* Only the rest of the block is read from the device */
+      return d->methods->read(d, pos + l, buf + l, len - l);
+    }
   return d->methods->read(d, pos, buf, len);
 }
 
+/*
+ *  Every VPD access is a slow handshake with the device, so we keep the part
+ *  of the VPD read so far in memory. Reads which extend it are merged with
+ *  the gap to a single request to the back end, reads elsewhere go directly
+ *  to the device.
+ */
 int
 pci_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  return d->methods->read_vpd ? d->methods->read_vpd(d, pos, buf, len) : 0;
+  int end = pos + len;
+
+  if (!d->methods->read_vpd)
+    return 0;
+  if (pos < 0 || len <= 0 || end > PCI_VPD_ADDR_MASK + 1 || pos > d->vpd_cache_len)
+    return d->methods->read_vpd(d, pos, buf, len);
+
+  if (end > d->vpd_cache_len)
+    {
+      if (!d->vpd_cache)
+	d->vpd_cache = pci_malloc(d->access, PCI_VPD_ADDR_MASK + 1);
+      if (!d->methods->read_vpd(d, d->vpd_cache_len, d->vpd_cache + d->vpd_cache_len, end - d->vpd_cache_len))
+	return 0;
+      d->vpd_cache_len = end;
+    }
+  memcpy(buf, d->vpd_cache + pos, len);
+  return 1;
 }
 
 static inline int
@@ -145,6 +180,8 @@ pci_write_data(struct pci_dev *d, void *buf, int pos, int len)
     d->access->error("Unaligned write: pos=%02x,len=%d", pos, len);
   if (pos + len <= d->cache_len)
     memcpy(d->cache + pos, buf, len);
+  if (pos < d->prefetch_len)		/* The write can have side effects (e.g., write-1-to-clear bits) */
+    d->prefetch_len = pos;
   return d->methods->write(d, pos, buf, len);
 }
 
@@ -176,6 +213,8 @@ pci_write_block(struct pci_dev *d, int pos, byte *buf, int len)
       int l = (pos + len >= d->cache_len) ? (d->cache_len - pos) : len;
       memcpy(d->cache + pos, buf, l);
     }
+  if (pos >= 0 && pos < d->prefetch_len)
+    d->prefetch_len = pos;
   return d->methods->write(d, pos, buf, len);
 }
 
@@ -230,6 +269,29 @@ pci_setup_cache(struct pci_dev *d, byte *cache, int len)
   d->cache_len = len;
 }
 
+void
+pci_prefetch_config(struct pci_access *a, int len)
+{
+  struct pci_dev *d;
+
+  if (len > 4096)
+    len = 4096;
+
+  for (d = a->devices; d; d = d->next)
+    {
+      pci_mfree(d->prefetch);
+      d->prefetch = (len > 0 && !d->no_config_access) ? pci_malloc(a, len) : NULL;
+      d->prefetch_len = 0;
+    }
+  if (len <= 0)
+    return;
+
+  if (a->methods->prefetch)
+    a->methods->prefetch(a, len);
+  else
+    pci_generic_prefetch(a, len);
+}
+
 char *
 pci_set_property(struct pci_dev *d, u32 key, char *value)
 {
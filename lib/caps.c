@@ -12,6 +12,15 @@
 
 #include "internal.h"
 
+/*
+ *  Length assumed for the last capability of each space, where there is no
+ *  next capability to bound it. They are long enough for all standard
+ *  traditional capabilities and for the fixed parts of the common extended
+ *  ones (AER, SR-IOV, DPC etc.).
+ */
+#define CAP_LAST_LEN 0x40
+#define CAP_LAST_LEN_EXT 0x100
+
 static void
 pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int type)
 {
@@ -26,6 +35,8 @@ pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int
   cap->addr = addr;
   cap->id = id;
   cap->type = type;
+  cap->len = 0;
+  cap->data = NULL;
   d->access->debug("%04x:%02x:%02x.%d: Found capability %04x of type %d at %04x\n",
     d->domain, d->bus, d->dev, d->func, id, type, addr);
 }
@@ -44,8 +55,9 @@ pci_scan_trad_caps(struct pci_dev *d)
   where = pci_read_byte(d, PCI_CAPABILITY_LIST) & ~3;
   while (where)
     {
-      byte id = pci_read_byte(d, where + PCI_CAP_LIST_ID);
-      byte next = pci_read_byte(d, where + PCI_CAP_LIST_NEXT) & ~3;
+      word header = pci_read_word(d, where + PCI_CAP_LIST_ID);
+      byte id = header & 0xff;
+      byte next = (header >> 8) & ~3;
       if (been_there[where]++)
 	break;
       if (id == 0xff)
@@ -82,6 +94,29 @@ pci_scan_ext_caps(struct pci_dev *d)
   while (where);
 }
 
+/*
+ *  A capability is assumed to extend up to the next capability in the same
+ *  space (in address order, not in chain order). The last one is given
+ *  last_len bytes, but neither goes beyond the end of the space.
+ */
+static void
+pci_set_cap_lengths(struct pci_dev *d, unsigned int type, unsigned int end, unsigned int last_len)
+{
+  struct pci_cap *c, *o;
+
+  for (c = d->first_cap; c; c = c->next)
+    if (c->type == type && c->addr < end)
+      {
+	unsigned int next = end;
+	for (o = d->first_cap; o; o = o->next)
+	  if (o->type == type && o->addr > c->addr && o->addr < next)
+	    next = o->addr;
+	if (next == end && next > c->addr + last_len)
+	  next = c->addr + last_len;
+	c->len = next - c->addr;
+      }
+}
+
 void
 pci_scan_caps(struct pci_dev *d, unsigned int want_fields)
 {
@@ -89,9 +124,15 @@ pci_scan_caps(struct pci_dev *d, unsigned int want_fields)
     want_fields |= PCI_FILL_CAPS;
 
   if (want_fill(d, want_fields, PCI_FILL_CAPS))
-    pci_scan_trad_caps(d);
+    {
+      pci_scan_trad_caps(d);
+      pci_set_cap_lengths(d, PCI_CAP_NORMAL, 0x100, CAP_LAST_LEN);
+    }
   if (want_fill(d, want_fields, PCI_FILL_EXT_CAPS))
-    pci_scan_ext_caps(d);
+    {
+      pci_scan_ext_caps(d);
+      pci_set_cap_lengths(d, PCI_CAP_EXTENDED, 0x1000, CAP_LAST_LEN_EXT);
+    }
 }
 
 void
@@ -102,10 +143,34 @@ pci_free_caps(struct pci_dev *d)
   while (cap = d->first_cap)
     {
       d->first_cap = cap->next;
+      pci_mfree(cap->data);
       pci_mfree(cap);
     }
 }
 
+struct pci_cap *
+pci_get_cap_table(struct pci_dev *d, unsigned int flags)
+{
+  struct pci_cap *c;
+
+  flags &= PCI_FILL_CAPS | PCI_FILL_EXT_CAPS;
+  pci_fill_info_v313(d, flags);
+
+  for (c=d->first_cap; c; c=c->next)
+    if (!c->data && c->len &&
+	(flags & ((c->type == PCI_CAP_NORMAL) ? PCI_FILL_CAPS : PCI_FILL_EXT_CAPS)))
+      {
+	c->data = pci_malloc(d->access, c->len);
+	if (!pci_read_block(d, c->addr, c->data, c->len))
+	  {
+	    pci_mfree(c->data);
+	    c->data = NULL;
+	  }
+      }
+
+  return d->first_cap;
+}
+
 struct pci_cap *
 pci_find_cap(struct pci_dev *d, unsigned int id, unsigned int type)
 {
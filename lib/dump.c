@@ -9,21 +9,60 @@
  */
 
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <errno.h>
 
 #include "internal.h"
 
+#ifdef PCI_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 struct dump_data {
   int len, allocated;
-  byte data[1];
+  byte *data;				/* Points either to buf[] or to the binary dump */
+  byte buf[1];
+};
+
+/*
+ *  Besides the text output of `lspci -x', we can read dumps in a binary
+ *  format, which can be served directly from a memory mapping. It consists
+ *  of a header, a table of devices and raw images of their config space.
+ *  All numbers are in host byte order, the version field doubles as a byte
+ *  order check.
+ */
+
+#define BIN_MAGIC "PCI-DMP\n"
+#define BIN_VERSION 2
+#define BIN_ALIGN(x) (((x) + 15) & ~15)
+
+struct bin_header {
+  char magic[8];
+  u32 version;
+  u32 count;				/* Number of devices */
+  u32 entry_size;			/* Size of struct bin_entry */
+  u32 reserved;
+};
+
+struct bin_entry {
+  u32 domain;
+  byte bus, dev, func, reserved;
+  u32 len;				/* Number of bytes of config space available */
+  u32 pad;				/* Keeps the layout the same on all ABIs */
+  u64 offset;				/* Position of the image in the file */
+};
+
+struct dump_access {
+  byte *map;				/* Contents of a binary dump */
+  size_t map_len;
+  int mapped;				/* ... mmapped rather than read to memory */
 };
 
 static void
 dump_config(struct pci_access *a)
 {
   pci_define_param(a, "dump.name", "", "Name of the bus dump file to read from");
+  pci_define_param(a, "dump.save", "", "Name of a file where the dump is written in the binary format");
 }
 
 static int
@@ -39,102 +78,305 @@ dump_alloc_data(struct pci_dev *dev, int len)
   struct dump_data *dd = pci_malloc(dev->access, sizeof(struct dump_data) + len - 1);
   dd->allocated = len;
   dd->len = 0;
+  dd->data = dd->buf;
   memset(dd->data, 0xff, len);
   dev->backend_data = dd;
 }
 
 static int
-dump_validate(char *s, char *fmt)
+dump_bin_load(struct pci_access *a, FILE *f, char *name)
 {
-  while (*fmt)
+  struct dump_access *da;
+  struct bin_header *hdr;
+  struct bin_entry *e;
+  size_t len;
+  byte *map;
+  u32 i;
+
+  if (fseek(f, 0, SEEK_END) < 0 || (long) (len = ftell(f)) < 0)
+    return 0;
+  rewind(f);
+
+#ifdef PCI_HAVE_MMAP
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (map == MAP_FAILED)
+    a->error("dump: Cannot map %s: %s", name, strerror(errno));
+#else
+  map = pci_malloc(a, len);
+  if (fread(map, 1, len, f) != len)
+    a->error("dump: Error reading %s", name);
+#endif
+
+  da = pci_malloc(a, sizeof(*da));
+  da->map = map;
+  da->map_len = len;
+#ifdef PCI_HAVE_MMAP
+  da->mapped = 1;
+#else
+  da->mapped = 0;
+#endif
+  a->backend_data = da;
+
+  hdr = (struct bin_header *) map;
+  if (len < sizeof(*hdr) ||
+      hdr->version != BIN_VERSION ||
+      hdr->entry_size != sizeof(struct bin_entry) ||
+      hdr->count > (len - sizeof(*hdr)) / sizeof(struct bin_entry))
+    a->error("dump: %s is not a valid binary dump", name);
+
+  e = (struct bin_entry *) (hdr + 1);
+  for (i=0; i < hdr->count; i++, e++)
     {
-      if (*fmt == '#' ? !isxdigit(*s) : *fmt != *s)
-	return 0;
-      fmt++, s++;
+      struct pci_dev *dev;
+      struct dump_data *dd;
+      if (e->len > 4096 || e->offset > len || e->len > len - e->offset)
+	a->error("dump: %s is not a valid binary dump", name);
+      dev = pci_get_dev(a, e->domain, e->bus, e->dev, e->func);
+      dd = pci_malloc(a, sizeof(struct dump_data));
+      dd->allocated = 0;
+      dd->len = e->len;
+      dd->data = map + e->offset;
+      dev->backend_data = dd;
+      pci_link_dev(a, dev);
     }
+  a->debug("dump: Mapped %u devices from %s\n", hdr->count, name);
   return 1;
 }
 
+/* Write all devices in the binary format, in the order they appeared in the dump */
 static void
-dump_init(struct pci_access *a)
+dump_bin_save(struct pci_access *a, char *name)
 {
-  char *name = pci_get_param(a, "dump.name");
+  struct bin_header hdr;
+  struct bin_entry e;
+  struct pci_dev **devs, *d;
+  static const byte zeroes[16];
+  u64 offset;
+  int i, count;
   FILE *f;
-  char buf[256];
-  struct pci_dev *dev = NULL;
-  int len, mn, bn, dn, fn, i, j;
 
-  if (!name)
-    a->error("dump: File name not given.");
-  if (!(f = fopen(name, "r")))
-    a->error("dump: Cannot open %s: %s", name, strerror(errno));
-  while (fgets(buf, sizeof(buf)-1, f))
+  count = 0;
+  for (d = a->devices; d; d = d->next)
+    count++;
+  devs = pci_malloc(a, (count + 1) * sizeof(*devs));
+  i = count;
+  for (d = a->devices; d; d = d->next)
+    devs[--i] = d;
+
+  if (!(f = fopen(name, "wb")))
+    a->error("dump: Cannot create %s: %s", name, strerror(errno));
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BIN_MAGIC, sizeof(hdr.magic));
+  hdr.version = BIN_VERSION;
+  hdr.count = count;
+  hdr.entry_size = sizeof(struct bin_entry);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  memset(&e, 0, sizeof(e));
+  offset = BIN_ALIGN(sizeof(hdr) + count * sizeof(e));
+  for (i=0; i<count; i++)
     {
-      char *z = strchr(buf, '\n');
-      if (!z)
-	{
-	  fclose(f);
-	  a->error("dump: line too long or unterminated");
-	}
-      *z-- = 0;
-      if (z >= buf && *z == '\r')
-	*z-- = 0;
-      len = z - buf + 1;
-      mn = 0;
-      if (dump_validate(buf, "##:##.# ") && sscanf(buf, "%x:%x.%d", &bn, &dn, &fn) == 3 ||
-	  dump_validate(buf, "####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4 ||
-	  dump_validate(buf, "#####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4 ||
-	  dump_validate(buf, "######:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4)
+      struct dump_data *dd = devs[i]->backend_data;
+      e.domain = devs[i]->domain;
+      e.bus = devs[i]->bus;
+      e.dev = devs[i]->dev;
+      e.func = devs[i]->func;
+      e.len = dd->len;
+      e.offset = offset;
+      offset += BIN_ALIGN(dd->len);
+      fwrite(&e, sizeof(e), 1, f);
+    }
+  fwrite(zeroes, BIN_ALIGN(sizeof(hdr) + count * sizeof(e)) - (sizeof(hdr) + count * sizeof(e)), 1, f);
+
+  for (i=0; i<count; i++)
+    {
+      struct dump_data *dd = devs[i]->backend_data;
+      fwrite(dd->data, dd->len, 1, f);
+      fwrite(zeroes, BIN_ALIGN(dd->len) - dd->len, 1, f);
+    }
+  pci_mfree(devs);
+
+  fflush(f);
+  if (ferror(f))
+    a->error("dump: Error writing %s", name);
+  fclose(f);
+  a->debug("dump: Saved %d devices to %s\n", count, name);
+}
+
+/* Values of hexadecimal digits plus one, zero for other characters */
+static const byte dump_hex[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#define HEX(c) dump_hex[(byte)(c)]
+
+static u32
+dump_hex_value(char *s, int n)
+{
+  u32 x = 0;
+  while (n--)
+    x = (x << 4) | (HEX(*s++) - 1);
+  return x;
+}
+
+/*
+ *  Process a single NUL-terminated line of the text dump. We recognize
+ *  device lines "[DDDD:]BB:DD.F ..." with 4 to 6 digits of the domain
+ *  and data lines "OFFS: XX XX ..." with 2 to 8 digits of the offset,
+ *  everything else is ignored. Returns an error message or NULL.
+ */
+static char *
+dump_parse_line(struct pci_access *a, char *s, int len, struct pci_dev **devp)
+{
+  struct pci_dev *dev = *devp;
+  struct dump_data *dd;
+  char *t, *z;
+  u32 i;
+  int n;
+
+  if (len && s[len-1] == '\r')
+    s[--len] = 0;
+  if (!len)
+    {
+      *devp = NULL;
+      return NULL;
+    }
+
+  for (n=0; n < 9 && HEX(s[n]); n++)
+    ;
+  if (s[n] != ':')
+    return NULL;
+
+  if (n == 2 || n >= 4 && n <= 6)
+    {
+      t = (n == 2) ? s : s + n + 1;
+      if (HEX(t[0]) && HEX(t[1]) && t[2] == ':' && HEX(t[3]) && HEX(t[4]) && t[5] == '.' &&
+	  t[6] >= '0' && t[6] <= '9' && t[7] == ' ')
 	{
-	  dev = pci_get_dev(a, mn, bn, dn, fn);
+	  dev = pci_get_dev(a, (n == 2) ? 0 : dump_hex_value(s, n), dump_hex_value(t, 2),
+			    dump_hex_value(t+3, 2), t[6] - '0');
 	  dump_alloc_data(dev, 256);
 	  pci_link_dev(a, dev);
+	  *devp = dev;
+	  return NULL;
 	}
-      else if (!len)
-	dev = NULL;
-      else if (dev &&
-	       (dump_validate(buf, "##: ") || dump_validate(buf, "###: ") || dump_validate(buf, "####: ") ||
-		dump_validate(buf, "#####: ") || dump_validate(buf, "######: ") ||
-		dump_validate(buf, "#######: ") || dump_validate(buf, "########: ")) &&
-	       sscanf(buf, "%x: ", &i) == 1)
+    }
+
+  if (!dev || n < 2 || n > 8 || s[n+1] != ' ')
+    return NULL;
+
+  dd = dev->backend_data;
+  i = dump_hex_value(s, n);
+  z = s + n + 2;
+  while (HEX(z[0]) && HEX(z[1]) && (!z[2] || z[2] == ' '))
+    {
+      if (i >= 4096)
+	return "At most 4096 bytes of config space are supported";
+      if (i >= (u32) dd->allocated)	/* Need to re-allocate the buffer */
 	{
-	  struct dump_data *dd = dev->backend_data;
-	  z = strchr(buf, ' ') + 1;
-	  while (isxdigit(z[0]) && isxdigit(z[1]) && (!z[2] || z[2] == ' ') &&
-		 sscanf(z, "%x", &j) == 1 && j < 256)
-	    {
-	      if (i >= 4096)
-		{
-		  fclose(f);
-		  a->error("dump: At most 4096 bytes of config space are supported");
-		}
-	      if (i >= dd->allocated)	/* Need to re-allocate the buffer */
-		{
-		  dump_alloc_data(dev, 4096);
-		  memcpy(((struct dump_data *) dev->backend_data)->data, dd->data, 256);
-		  pci_mfree(dd);
-		  dd = dev->backend_data;
-		}
-	      dd->data[i++] = j;
-	      if (i > dd->len)
-		dd->len = i;
-	      z += 2;
-	      if (*z)
-		z++;
-	    }
-	  if (*z)
+	  dump_alloc_data(dev, 4096);
+	  memcpy(((struct dump_data *) dev->backend_data)->data, dd->data, 256);
+	  pci_mfree(dd);
+	  dd = dev->backend_data;
+	}
+      dd->data[i++] = ((HEX(z[0]) - 1) << 4) | (HEX(z[1]) - 1);
+      if ((int) i > dd->len)
+	dd->len = i;
+      z += 2;
+      if (*z)
+	z++;
+    }
+  if (*z)
+    return "Malformed line";
+  return NULL;
+}
+
+#define DUMP_BUF_SIZE 65536
+
+static void
+dump_init(struct pci_access *a)
+{
+  char *name = pci_get_param(a, "dump.name");
+  char *save = pci_get_param(a, "dump.save");
+  struct pci_dev *dev = NULL;
+  char *buf, *start, *end, *err;
+  size_t have, n;
+  FILE *f;
+
+  if (!name || !name[0])
+    a->error("dump: File name not given.");
+  if (!strcmp(name, "-"))
+    f = stdin;
+  else if (!(f = fopen(name, "rb")))
+    a->error("dump: Cannot open %s: %s", name, strerror(errno));
+
+  /* The text is processed in large chunks, so it can be streamed through a pipe */
+  buf = pci_malloc(a, DUMP_BUF_SIZE + 1);
+  have = fread(buf, 1, DUMP_BUF_SIZE, f);
+  if (have >= sizeof(BIN_MAGIC) - 1 && !memcmp(buf, BIN_MAGIC, sizeof(BIN_MAGIC) - 1))
+    {
+      if (f == stdin || !dump_bin_load(a, f, name))
+	a->error("dump: Binary dumps must be read from a regular file");
+      goto close;
+    }
+
+  while (have)
+    {
+      char *nl;
+      start = buf;
+      end = buf + have;
+      while (nl = memchr(start, '\n', end - start))
+	{
+	  *nl = 0;
+	  if (err = dump_parse_line(a, start, nl - start, &dev))
 	    {
-	      fclose(f);
-	      a->error("dump: Malformed line");
+	      if (f != stdin)
+		fclose(f);
+	      a->error("dump: %s", err);
 	    }
+	  start = nl + 1;
+	}
+      have = end - start;
+      if (have == DUMP_BUF_SIZE || have && feof(f))
+	{
+	  if (f != stdin)
+	    fclose(f);
+	  a->error("dump: line too long or unterminated");
 	}
+      memmove(buf, start, have);
+      n = fread(buf + have, 1, DUMP_BUF_SIZE - have, f);
+      if (!n && ferror(f))
+	a->error("dump: Error reading %s: %s", name, strerror(errno));
+      have += n;
     }
-  fclose(f);
+
+close:
+  pci_mfree(buf);
+  if (f != stdin)
+    fclose(f);
+  if (save && save[0])
+    dump_bin_save(a, save);
 }
 
 static void
-dump_cleanup(struct pci_access *a UNUSED)
+dump_cleanup(struct pci_access *a)
 {
+  struct dump_access *da = a->backend_data;
+
+  if (!da)
+    return;
+#ifdef PCI_HAVE_MMAP
+  if (da->mapped)
+    munmap(da->map, da->map_len);
+  else
+#endif
+    pci_mfree(da->map);
+  pci_mfree(da);
+  a->backend_data = NULL;
 }
 
 static void
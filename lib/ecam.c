@@ -19,6 +19,10 @@
 #include <string.h>
 #include <limits.h>
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #ifndef PCI_OS_WINDOWS
 #include <glob.h>
 #include <unistd.h>
@@ -84,7 +88,9 @@ struct acpi_mcfg {
   } allocations[0];
 } PCI_PACKED;
 
+// Mapping of a single bus, kept in a list ordered by last use
 struct mmap_cache {
+  struct mmap_cache *next;
   void *map;
   u64 addr;
   u32 length;
@@ -93,10 +99,30 @@ struct mmap_cache {
   int w;
 };
 
+// Location of a single bus, zero length if the bus has no ECAM region
+struct ecam_bus {
+  u64 addr;
+  u32 length;
+};
+
+// Buses of a single domain, compiled from MCFG or ecam.addrs at init time
+struct ecam_domain {
+  int domain;
+  struct ecam_bus buses[256];
+};
+
 // Back-end data linked to struct pci_access
 struct ecam_access {
   struct acpi_mcfg *mcfg;
-  struct mmap_cache *cache;
+  struct ecam_domain *domains;	// Sorted by domain number
+  int num_domains;
+  struct mmap_cache *cache;	// Most recently used first
+  u64 cache_size;		// Total length of cached mappings
+  u64 cache_limit;
+  int threaded;			// Parallel scan running, cache is locked and never shrinks
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_t lock;
+#endif
   struct physmem *physmem;
   long pagesize;
 };
@@ -755,97 +781,213 @@ calculate_bus_addr(u8 start_bus, u64 start_addr, u32 total_length, u8 bus, u64 *
   return 1;
 }
 
-static int
-get_bus_addr(struct acpi_mcfg *mcfg, const char *addrs, int domain, u8 bus, u64 *addr, u32 *length)
+static struct ecam_domain *
+find_domain(struct ecam_access *eacc, int domain)
+{
+  int lo = 0, hi = eacc->num_domains;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (eacc->domains[mid].domain == domain)
+        return &eacc->domains[mid];
+      if (eacc->domains[mid].domain < domain)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return NULL;
+}
+
+static void
+add_bus_range(struct pci_access *a, struct ecam_access *eacc, int domain, u8 start_bus, u8 end_bus, u64 start_addr, u32 total_length)
 {
-  int cur_domain;
+  struct ecam_domain *d = find_domain(eacc, domain);
+  struct ecam_domain *domains;
+  struct ecam_bus *b;
+  int i, bus;
+
+  if (!d)
+    {
+      for (i = 0; i < eacc->num_domains && eacc->domains[i].domain < domain; i++)
+        ;
+      domains = pci_malloc(a, (eacc->num_domains + 1) * sizeof(*domains));
+      memcpy(domains, eacc->domains, i * sizeof(*domains));
+      memcpy(domains + i + 1, eacc->domains + i, (eacc->num_domains - i) * sizeof(*domains));
+      pci_mfree(eacc->domains);
+      eacc->domains = domains;
+      eacc->num_domains++;
+      d = &domains[i];
+      memset(d, 0, sizeof(*d));
+      d->domain = domain;
+    }
+
+  // When ranges overlap, the first one wins
+  for (bus = start_bus; bus <= end_bus; bus++)
+    {
+      b = &d->buses[bus];
+      if (!b->length)
+        calculate_bus_addr(start_bus, start_addr, total_length, bus, &b->addr, &b->length);
+    }
+}
+
+static void
+compile_bus_table(struct pci_access *a, struct ecam_access *eacc, const char *addrs)
+{
+  int domain;
   u8 start_bus;
   u8 end_bus;
   u64 start_addr;
   u32 total_length;
   int i, count;
 
-  if (mcfg)
+  if (eacc->mcfg)
     {
-      count = get_mcfg_allocations_count(mcfg);
+      count = get_mcfg_allocations_count(eacc->mcfg);
       for (i = 0; i < count; i++)
         {
-          get_mcfg_allocation(mcfg, i, &cur_domain, &start_bus, &end_bus, &start_addr, &total_length);
-          if (domain == cur_domain && bus >= start_bus && bus <= end_bus)
-            return calculate_bus_addr(start_bus, start_addr, total_length, bus, addr, length);
+          get_mcfg_allocation(eacc->mcfg, i, &domain, &start_bus, &end_bus, &start_addr, &total_length);
+          add_bus_range(a, eacc, domain, start_bus, end_bus, start_addr, total_length);
         }
-      return 0;
     }
   else
     {
       while (addrs)
-        {
-          if (!parse_next_addrs(addrs, &addrs, &cur_domain, &start_bus, &end_bus, &start_addr, &total_length))
-            return 0;
-          if (domain == cur_domain && bus >= start_bus && bus <= end_bus)
-            return calculate_bus_addr(start_bus, start_addr, total_length, bus, addr, length);
-        }
-      return 0;
+        if (parse_next_addrs(addrs, &addrs, &domain, &start_bus, &end_bus, &start_addr, &total_length))
+          add_bus_range(a, eacc, domain, start_bus, end_bus, start_addr, total_length);
     }
 }
 
+static int
+get_bus_addr(struct ecam_access *eacc, int domain, u8 bus, u64 *addr, u32 *length)
+{
+  struct ecam_domain *d = find_domain(eacc, domain);
+
+  if (!d || !d->buses[bus].length)
+    return 0;
+
+  *addr = d->buses[bus].addr;
+  *length = d->buses[bus].length;
+  return 1;
+}
+
+static void
+munmap_cache(struct ecam_access *eacc, struct mmap_cache *cache)
+{
+  physmem_unmap(eacc->physmem, cache->map, cache->length + (cache->addr & (eacc->pagesize-1)));
+  eacc->cache_size -= cache->length;
+  pci_mfree(cache);
+}
+
 static void
 munmap_reg(struct pci_access *a)
 {
   struct ecam_access *eacc = a->backend_data;
-  struct mmap_cache *cache = eacc->cache;
-  struct physmem *physmem = eacc->physmem;
-  long pagesize = eacc->pagesize;
+  struct mmap_cache *cache;
 
-  if (!cache)
-    return;
+  while (cache = eacc->cache)
+    {
+      eacc->cache = cache->next;
+      munmap_cache(eacc, cache);
+    }
+}
 
-  physmem_unmap(physmem, cache->map, cache->length + (cache->addr & (pagesize-1)));
-  pci_mfree(cache);
-  eacc->cache = NULL;
+// Unmap least recently used buses until there is space for a new mapping
+static void
+shrink_cache(struct ecam_access *eacc, u32 length)
+{
+  struct mmap_cache **pp, *cache;
+
+  while (eacc->cache && eacc->cache_size + length > eacc->cache_limit)
+    {
+      for (pp = &eacc->cache; (*pp)->next; pp = &(*pp)->next)
+        ;
+      cache = *pp;
+      *pp = NULL;
+      munmap_cache(eacc, cache);
+    }
 }
 
 static int
-mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int pos, volatile void **reg)
+mmap_bus(struct pci_access *a, int w, int domain, u8 bus, void **mapp, u64 *addrp, u32 *lengthp)
 {
   struct ecam_access *eacc = a->backend_data;
-  struct mmap_cache *cache = eacc->cache;
+  struct mmap_cache *cache, **pp;
   struct physmem *physmem = eacc->physmem;
   long pagesize = eacc->pagesize;
-  const char *addrs;
   void *map;
   u64 addr;
   u32 length;
-  u32 offset;
 
-  if (cache && cache->domain == domain && cache->bus == bus && !!cache->w == !!w)
+  // Read-write mappings can be used for reading, too
+  for (pp = &eacc->cache; cache = *pp; pp = &cache->next)
+    if (cache->domain == domain && cache->bus == bus && (cache->w || !w))
+      break;
+
+  if (cache)
     {
+      if (pp != &eacc->cache)
+        {
+          *pp = cache->next;
+          cache->next = eacc->cache;
+          eacc->cache = cache;
+        }
       map = cache->map;
       addr = cache->addr;
       length = cache->length;
     }
   else
     {
-      addrs = pci_get_param(a, "ecam.addrs");
-      if (!get_bus_addr(eacc->mcfg, addrs, domain, bus, &addr, &length))
+      if (!get_bus_addr(eacc, domain, bus, &addr, &length))
         return 0;
 
+      if (!eacc->threaded)
+        shrink_cache(eacc, length);
       map = physmem_map(physmem, addr & ~(pagesize-1), length + (addr & (pagesize-1)), w);
       if (map == (void *)-1)
         return 0;
 
-      if (cache)
-        physmem_unmap(physmem, cache->map, cache->length + (cache->addr & (pagesize-1)));
-      else
-        cache = eacc->cache = pci_malloc(a, sizeof(*cache));
-
+      cache = pci_malloc(a, sizeof(*cache));
       cache->map = map;
       cache->addr = addr;
       cache->length = length;
       cache->domain = domain;
       cache->bus = bus;
       cache->w = w;
+      cache->next = eacc->cache;
+      eacc->cache = cache;
+      eacc->cache_size += length;
+    }
+
+  *mapp = map;
+  *addrp = addr;
+  *lengthp = length;
+  return 1;
+}
+
+static int
+mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int pos, volatile void **reg)
+{
+  struct ecam_access *eacc = a->backend_data;
+  long pagesize = eacc->pagesize;
+  void *map;
+  u64 addr;
+  u32 length;
+  u32 offset;
+  int ok;
+
+#ifdef PCI_HAVE_PTHREADS
+  if (eacc->threaded)
+    {
+      pthread_mutex_lock(&eacc->lock);
+      ok = mmap_bus(a, w, domain, bus, &map, &addr, &length);
+      pthread_mutex_unlock(&eacc->lock);
     }
+  else
+#endif
+    ok = mmap_bus(a, w, domain, bus, &map, &addr, &length);
+  if (!ok)
+    return 0;
 
   /*
    * Enhanced Configuration Access Mechanism (ECAM) offset according to:
@@ -873,6 +1015,10 @@ ecam_config(struct pci_access *a)
   pci_define_param(a, "ecam.x86bios", "1", "Scan x86 BIOS memory for ACPI MCFG table");
 #endif
   pci_define_param(a, "ecam.addrs", "", "Physical addresses of memory mapped PCIe ECAM interface"); /* format: [domain:]start_bus[-end_bus]:start_addr[+length],... */
+  pci_define_param(a, "ecam.cache_size", "65536", "Maximum size of mapped ECAM regions in kilobytes");
+#ifdef PCI_HAVE_PTHREADS
+  pci_define_param(a, "ecam.threads", "0", "Number of threads scanning domains and buses in parallel (0=disabled)");
+#endif
 }
 
 static int
@@ -992,7 +1138,11 @@ ecam_detect(struct pci_access *a)
         }
 
       eacc->mcfg = NULL;
+      eacc->domains = NULL;
+      eacc->num_domains = 0;
       eacc->cache = NULL;
+      eacc->cache_size = 0;
+      eacc->threaded = 0;
       a->backend_data = eacc;
       eacc->mcfg = find_mcfg(a, acpimcfg, efisystab, use_bsd, use_x86bios);
       if (!eacc->mcfg)
@@ -1048,7 +1198,11 @@ ecam_init(struct pci_access *a)
 
       eacc = pci_malloc(a, sizeof(*eacc));
       eacc->mcfg = NULL;
+      eacc->domains = NULL;
+      eacc->num_domains = 0;
       eacc->cache = NULL;
+      eacc->cache_size = 0;
+      eacc->threaded = 0;
       eacc->physmem = physmem;
       eacc->pagesize = pagesize;
       a->backend_data = eacc;
@@ -1075,6 +1229,9 @@ ecam_init(struct pci_access *a)
   else
     parse_next_addrs(addrs, NULL, &test_domain, &test_bus, NULL, NULL, NULL);
 
+  compile_bus_table(a, eacc, addrs);
+  eacc->cache_limit = (u64) strtoul(pci_get_param(a, "ecam.cache_size"), NULL, 10) * 1024;
+
   errno = 0;
   if (!mmap_reg(a, 0, test_domain, test_bus, 0, 0, 0, &test_reg))
     a->error("Cannot map ecam region: %s.", errno ? strerror(errno) : "Unknown error");
@@ -1088,6 +1245,7 @@ ecam_cleanup(struct pci_access *a)
   munmap_reg(a);
   physmem_close(eacc->physmem);
   pci_mfree(eacc->mcfg);
+  pci_mfree(eacc->domains);
   pci_mfree(eacc);
   a->backend_data = NULL;
 }
@@ -1095,53 +1253,52 @@ ecam_cleanup(struct pci_access *a)
 static void
 ecam_scan(struct pci_access *a)
 {
-  const char *addrs = pci_get_param(a, "ecam.addrs");
   struct ecam_access *eacc = a->backend_data;
-  u32 *segments;
-  int i, j, count;
-  int domain;
+  int threads = 0;
+  int *domains;
+  int i;
 
-  segments = pci_malloc(a, 0xFFFF/8);
-  memset(segments, 0, 0xFFFF/8);
+  domains = pci_malloc(a, (eacc->num_domains + 1) * sizeof(*domains));
+  for (i = 0; i < eacc->num_domains; i++)
+    domains[i] = eacc->domains[i].domain;
 
-  if (eacc->mcfg)
-    {
-      count = get_mcfg_allocations_count(eacc->mcfg);
-      for (i = 0; i < count; i++)
-        segments[eacc->mcfg->allocations[i].pci_segment / 32] |= 1 << (eacc->mcfg->allocations[i].pci_segment % 32);
-    }
-  else
+#ifdef PCI_HAVE_PTHREADS
+  /*
+   *  Worker threads share the mapping cache. While they run, it is protected
+   *  by a lock and it only grows, so that pointers to mapped registers stay
+   *  valid without holding the lock during the access itself.
+   */
+  threads = atoi(pci_get_param(a, "ecam.threads"));
+  if (threads > 1)
     {
-      while (addrs)
-        {
-          if (parse_next_addrs(addrs, &addrs, &domain, NULL, NULL, NULL, NULL))
-            segments[domain / 32] |= 1 << (domain % 32);
-        }
+      pthread_mutex_init(&eacc->lock, NULL);
+      eacc->threaded = 1;
     }
+#endif
 
-  for (i = 0; i < 0xFFFF/32; i++)
+  pci_generic_scan_domains(a, domains, eacc->num_domains, threads);
+
+#ifdef PCI_HAVE_PTHREADS
+  if (eacc->threaded)
     {
-      if (!segments[i])
-        continue;
-      for (j = 0; j < 32; j++)
-        if (segments[i] & (1 << j))
-          pci_generic_scan_domain(a, 32*i + j);
+      eacc->threaded = 0;
+      pthread_mutex_destroy(&eacc->lock);
+      shrink_cache(eacc, 0);
     }
+#endif
 
-  pci_mfree(segments);
+  pci_mfree(domains);
 }
 
 static int
 ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  volatile void *reg;
+  volatile void *reg, *end;
+  volatile unsigned char *p;
 
-  if (pos >= 4096)
+  if (pos >= 4096 || len > 4096 - pos)
     return 0;
 
-  if (len != 1 && len != 2 && len != 4)
-    return pci_generic_block_read(d, pos, buf, len);
-
   if (!mmap_reg(d->access, 0, d->domain, d->bus, d->dev, d->func, pos, &reg))
     return 0;
 
@@ -1149,18 +1306,76 @@ ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
     {
     case 1:
       buf[0] = physmem_readb(reg);
-      break;
+      return 1;
     case 2:
       ((u16 *) buf)[0] = physmem_readw(reg);
-      break;
+      return 1;
     case 4:
       ((u32 *) buf)[0] = physmem_readl(reg);
-      break;
+      return 1;
+    }
+
+  /*
+   *  Block reads use the same access sizes as pci_generic_block_read(),
+   *  but the whole function is covered by a single mapping, so it needs
+   *  to be looked up only once. The mapping of the last bus can be shorter,
+   *  though, so we check that it covers the end of the block, too.
+   */
+  if (!mmap_reg(d->access, 0, d->domain, d->bus, d->dev, d->func, (pos + len - 1) & ~3, &end))
+    return 0;
+  p = reg;
+  if ((pos & 1) && len >= 1)
+    {
+      *buf = physmem_readb(p);
+      pos++; p++; buf++; len--;
     }
+  if ((pos & 3) && len >= 2)
+    {
+      u16 w = physmem_readw(p);
+      memcpy(buf, &w, 2);
+      pos += 2; p += 2; buf += 2; len -= 2;
+    }
+  while (len >= 4)
+    {
+      u32 l = physmem_readl(p);
+      memcpy(buf, &l, 4);
+      p += 4; buf += 4; len -= 4;
+    }
+  if (len >= 2)
+    {
+      u16 w = physmem_readw(p);
+      memcpy(buf, &w, 2);
+      p += 2; buf += 2; len -= 2;
+    }
+  if (len)
+    *buf = physmem_readb(p);
 
   return 1;
 }
 
+static void
+ecam_prefetch(struct pci_access *a, int len)
+{
+  volatile void *reg, *end;
+  struct pci_dev *d;
+  int i;
+
+  len &= ~3;
+  if (!len)
+    return;
+
+  for (d = a->devices; d; d = d->next)
+    if (d->prefetch)
+      {
+        if (!mmap_reg(a, 0, d->domain, d->bus, d->dev, d->func, 0, &reg) ||
+            !mmap_reg(a, 0, d->domain, d->bus, d->dev, d->func, len - 4, &end))
+          continue;
+        for (i = 0; i < len; i += 4)
+          ((u32 *) d->prefetch)[i/4] = physmem_readl((volatile unsigned char *)reg + i);
+        d->prefetch_len = len;
+      }
+}
+
 static int
 ecam_write(struct pci_dev *d, int pos, byte *buf, int len)
 {
@@ -1202,4 +1417,5 @@ struct pci_methods pm_ecam = {
   .fill_info = pci_generic_fill_info,
   .read = ecam_read,
   .write = ecam_write,
+  .prefetch = ecam_prefetch,
 };
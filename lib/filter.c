@@ -224,6 +224,125 @@ pci_filter_match_v38(struct pci_filter *f, struct pci_dev *d)
   return 1;
 }
 
+/*
+ *  Sets of filters are compiled to hash tables indexed by the most specific
+ *  part of each filter: bus and slot numbers, vendor ID, or device class.
+ *  Filters specifying neither of them are kept in a separate list. For each
+ *  device, we look up the candidates in all tables, which yields ordered lists
+ *  of filter indices, and we check them by pci_filter_match() while merging.
+ */
+
+struct filter_node {
+  struct filter_node *next;
+  int index;
+};
+
+struct pci_filter_set {
+  int count;
+  struct pci_filter *filters;		/* Copies of the filters */
+  struct filter_node *nodes;
+  unsigned int hash_size;		/* A power of two */
+  struct filter_node **by_slot, **by_vendor, **by_class;
+  struct filter_node *other;
+  int num_vendor, num_class;		/* Number of filters in the respective tables */
+};
+
+static inline unsigned int
+filter_hash(struct pci_filter_set *s, unsigned int key)
+{
+  return (key * 0x9e3779b1) >> 8 & (s->hash_size - 1);
+}
+
+struct pci_filter_set *
+pci_filter_set_compile(struct pci_access *a, struct pci_filter **filters, int count)
+{
+  struct pci_filter_set *s = pci_malloc(a, sizeof(*s));
+  struct filter_node **list;
+  int i;
+
+  memset(s, 0, sizeof(*s));
+  s->count = count;
+  s->filters = pci_malloc(a, (count + 1) * sizeof(struct pci_filter));
+  s->nodes = pci_malloc(a, (count + 1) * sizeof(struct filter_node));
+  s->hash_size = 16;
+  while (s->hash_size < (unsigned int) count)
+    s->hash_size *= 2;
+  s->by_slot = pci_malloc(a, 3 * s->hash_size * sizeof(struct filter_node *));
+  memset(s->by_slot, 0, 3 * s->hash_size * sizeof(struct filter_node *));
+  s->by_vendor = s->by_slot + s->hash_size;
+  s->by_class = s->by_vendor + s->hash_size;
+
+  /* Insert in reverse order, so that all lists are sorted by the index */
+  for (i = count-1; i >= 0; i--)
+    {
+      struct pci_filter *f = &s->filters[i];
+      *f = *filters[i];
+      if (f->bus >= 0 && f->slot >= 0)
+	list = &s->by_slot[filter_hash(s, f->bus * 32 + f->slot)];
+      else if (f->vendor >= 0)
+	{
+	  list = &s->by_vendor[filter_hash(s, f->vendor)];
+	  s->num_vendor++;
+	}
+      else if (f->device_class >= 0 && (f->device_class_mask & 0xffff) == 0xffff)
+	{
+	  list = &s->by_class[filter_hash(s, f->device_class & 0xffff)];
+	  s->num_class++;
+	}
+      else
+	list = &s->other;
+      s->nodes[i].index = i;
+      s->nodes[i].next = *list;
+      *list = &s->nodes[i];
+    }
+  return s;
+}
+
+int
+pci_filter_set_match(struct pci_filter_set *s, struct pci_dev *d, int *result)
+{
+  struct filter_node *lists[4];
+  int i, best, n = 0;
+
+  lists[0] = s->by_slot[filter_hash(s, d->bus * 32 + d->dev)];
+  lists[1] = NULL;
+  lists[2] = NULL;
+  lists[3] = s->other;
+  if (s->num_vendor)
+    {
+      pci_fill_info_v313(d, PCI_FILL_IDENT);
+      lists[1] = s->by_vendor[filter_hash(s, d->vendor_id)];
+    }
+  if (s->num_class)
+    {
+      pci_fill_info_v313(d, PCI_FILL_CLASS);
+      lists[2] = s->by_class[filter_hash(s, d->device_class)];
+    }
+
+  for (;;)
+    {
+      best = -1;
+      for (i=0; i<4; i++)
+	if (lists[i] && (best < 0 || lists[i]->index < lists[best]->index))
+	  best = i;
+      if (best < 0)
+	break;
+      if (pci_filter_match_v38(&s->filters[lists[best]->index], d))
+	result[n++] = lists[best]->index;
+      lists[best] = lists[best]->next;
+    }
+  return n;
+}
+
+void
+pci_filter_set_free(struct pci_filter_set *s)
+{
+  pci_mfree(s->filters);
+  pci_mfree(s->nodes);
+  pci_mfree(s->by_slot);
+  pci_mfree(s);
+}
+
 /*
  * Before pciutils v3.3, struct pci_filter had fewer fields,
  * so we have to provide compatibility wrappers.
@@ -8,15 +8,94 @@
  *	SPDX-License-Identifier: GPL-2.0-or-later
  */
 
+#include <errno.h>
 #include <string.h>
 
 #include "internal.h"
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+ *  Probe a single function at the position of the template device t.
+ *  Returns a new device or NULL if there is no function. If the function
+ *  is a bridge whose secondary bus should be scanned, *sec_bus is set to
+ *  its number, otherwise to -1.
+ *
+ *  Besides the IDs and the header type, we read the class and revision
+ *  dword of each function found, so that pci_fill_info() need not read
+ *  them again. Registers which may change (command, status, BIST etc.)
+ *  are not touched.
+ */
+static struct pci_dev *
+scan_function(struct pci_access *a, struct pci_dev *t, int *multi, int *sec_bus)
+{
+  u32 vd = pci_read_long(t, PCI_VENDOR_ID);
+  struct pci_dev *d;
+  int hiding = 0;
+  u32 cr;
+  int ht;
+
+  *sec_bus = -1;
+  if (!vd)
+    return NULL;
+
+  if (vd == 0xffffffff)
+    {
+      /*  some devices may hide themselves by setting their vendor and device ID to
+       *  ffff:ffff so we check other registers
+       */
+      u32 command = pci_read_long(t, PCI_COMMAND);
+
+      /* if command is also ffffffff then there's probably no device here */
+      if (command == 0xffffffff)
+	return NULL;
+
+      /* if there is a command then assume there's a device here that is hiding itself */
+      hiding = 1;
+    }
+
+  cr = pci_read_long(t, PCI_CLASS_REVISION);
+  ht = pci_read_byte(t, PCI_HEADER_TYPE);
+  if (!t->func)
+    *multi = ht & 0x80;
+  ht &= 0x7f;
+  d = pci_alloc_dev(a);
+  d->hiding = hiding;
+  d->domain = t->domain;
+  d->bus = t->bus;
+  d->dev = t->dev;
+  d->func = t->func;
+  d->vendor_id = vd & 0xffff;
+  d->device_id = vd >> 16U;
+  d->known_fields = PCI_FILL_IDENT;
+  d->hdrtype = ht;
+  d->device_class = cr >> 16;
+  d->prog_if = (cr >> 8) & 0xff;
+  d->rev_id = cr & 0xff;
+  d->known_fields |= PCI_FILL_CLASS | PCI_FILL_CLASS_EXT;
+  switch (ht)
+    {
+    case PCI_HEADER_TYPE_NORMAL:
+      break;
+    case PCI_HEADER_TYPE_BRIDGE:
+    case PCI_HEADER_TYPE_CARDBUS:
+      if (!hiding)
+	*sec_bus = pci_read_byte(t, PCI_SECONDARY_BUS);
+      break;
+    default:
+      if (!hiding)
+	a->debug("Device %04x:%02x:%02x.%d has unknown header type %02x.\n", d->domain, d->bus, d->dev, d->func, ht);
+    }
+  return d;
+}
+
 void
 pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 {
-  int dev, multi, ht;
-  struct pci_dev *t;
+  int dev, multi, sec_bus;
+  struct pci_dev *t, *d;
 
   a->debug("Scanning bus %02x for devices...\n", bus);
   if (busmap[bus])
@@ -34,55 +113,12 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
       multi = 0;
       for (t->func=0; !t->func || multi && t->func<8; t->func++)
 	{
-	  u32 vd = pci_read_long(t, PCI_VENDOR_ID);
-	  struct pci_dev *d;
-
-	  if (!vd)
+	  d = scan_function(a, t, &multi, &sec_bus);
+	  if (!d)
 	    continue;
-	  
-	  int hiding = 0;
-	  if (vd == 0xffffffff)
-	    {
-	      /*  some devices may hide themselves by setting their vendor and device ID to
-	       *  ffff:ffff so we check other registers
-	       */
-	      u32 command = pci_read_long(t, PCI_COMMAND);
-	      
-	      /* if command is also ffffffff then there's probably no device here */
-	      if (command == 0xffffffff)
-	        continue;
-	      
-	      /* if there is a command then assume there's a device here that is hiding itself */
-	      hiding = 1;
-	    }
-	  ht = pci_read_byte(t, PCI_HEADER_TYPE);
-	  if (!t->func)
-	    multi = ht & 0x80;
-	  ht &= 0x7f;
-	  d = pci_alloc_dev(a);
-	  d->hiding = hiding;
-	  d->domain = t->domain;
-	  d->bus = t->bus;
-	  d->dev = t->dev;
-	  d->func = t->func;
-	  d->vendor_id = vd & 0xffff;
-	  d->device_id = vd >> 16U;
-	  d->known_fields = PCI_FILL_IDENT;
-	  d->hdrtype = ht;
 	  pci_link_dev(a, d);
-	  switch (ht)
-	    {
-	    case PCI_HEADER_TYPE_NORMAL:
-	      break;
-	    case PCI_HEADER_TYPE_BRIDGE:
-	    case PCI_HEADER_TYPE_CARDBUS:
-	      if (!hiding)
-	        pci_generic_scan_bus(a, busmap, domain, pci_read_byte(t, PCI_SECONDARY_BUS));
-	      break;
-	    default:
-	      if (!hiding)
-	        a->debug("Device %04x:%02x:%02x.%d has unknown header type %02x.\n", d->domain, d->bus, d->dev, d->func, ht);
-	    }
+	  if (sec_bus >= 0)
+	    pci_generic_scan_bus(a, busmap, domain, sec_bus);
 	}
     }
   pci_free_dev(t);
@@ -103,6 +139,234 @@ pci_generic_scan(struct pci_access *a)
   pci_generic_scan_domain(a, 0);
 }
 
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ *  Parallel scan: every bus is a job, which records the functions found
+ *  and the jobs for secondary buses in the order the sequential scan would
+ *  visit them. Workers never touch the device list; once all jobs are done,
+ *  the tree of jobs is walked and the devices linked exactly as
+ *  pci_generic_scan_bus() would have linked them.
+ */
+
+struct scan_job;
+
+struct scan_item {
+  struct pci_dev *dev;
+  struct scan_job *child;
+};
+
+struct scan_job {
+  struct scan_job *next;		/* In the queue of pending jobs */
+  int domain, bus;
+  byte *busmap;				/* Shared by all jobs of the domain */
+  struct scan_item *items;
+  int num_items, max_items;
+};
+
+struct scan_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct scan_job *queue;
+  int busy;				/* Jobs queued or running */
+};
+
+static struct scan_job *
+scan_new_job(struct pci_access *a, byte *busmap, int domain, int bus)
+{
+  struct scan_job *job = pci_malloc(a, sizeof(*job));
+
+  memset(job, 0, sizeof(*job));
+  job->domain = domain;
+  job->bus = bus;
+  job->busmap = busmap;
+  return job;
+}
+
+static void
+scan_add_item(struct pci_access *a, struct scan_job *job, struct pci_dev *dev, struct scan_job *child)
+{
+  if (job->num_items == job->max_items)
+    {
+      int max = job->max_items ? 2 * job->max_items : 16;
+      struct scan_item *items = pci_malloc(a, max * sizeof(*items));
+      memcpy(items, job->items, job->num_items * sizeof(*items));
+      pci_mfree(job->items);
+      job->items = items;
+      job->max_items = max;
+    }
+  job->items[job->num_items].dev = dev;
+  job->items[job->num_items].child = child;
+  job->num_items++;
+}
+
+static void
+scan_job_bus(struct pci_access *a, struct scan_pool *pool, struct scan_job *job)
+{
+  int dev, multi, sec_bus;
+  struct pci_dev *t, *d;
+  struct scan_job *child;
+
+  a->debug("Scanning bus %02x for devices...\n", job->bus);
+  t = pci_alloc_dev(a);
+  t->domain = job->domain;
+  t->bus = job->bus;
+  for (dev=0; dev<32; dev++)
+    {
+      t->dev = dev;
+      multi = 0;
+      for (t->func=0; !t->func || multi && t->func<8; t->func++)
+	{
+	  d = scan_function(a, t, &multi, &sec_bus);
+	  if (!d)
+	    continue;
+	  scan_add_item(a, job, d, NULL);
+	  if (sec_bus < 0)
+	    continue;
+
+	  pthread_mutex_lock(&pool->lock);
+	  if (job->busmap[sec_bus])
+	    child = NULL;
+	  else
+	    {
+	      job->busmap[sec_bus] = 1;
+	      child = scan_new_job(a, job->busmap, job->domain, sec_bus);
+	      child->next = pool->queue;
+	      pool->queue = child;
+	      pool->busy++;
+	      pthread_cond_signal(&pool->cond);
+	    }
+	  pthread_mutex_unlock(&pool->lock);
+
+	  if (child)
+	    scan_add_item(a, job, NULL, child);
+	  else
+	    a->warning("Bus %02x seen twice (firmware bug). Ignored.", sec_bus);
+	}
+    }
+  pci_free_dev(t);
+}
+
+struct scan_worker_arg {
+  struct pci_access *a;
+  struct scan_pool *pool;
+};
+
+static void *
+scan_worker(void *arg)
+{
+  struct scan_worker_arg *wa = arg;
+  struct scan_pool *pool = wa->pool;
+  struct scan_job *job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+    {
+      while (!pool->queue && pool->busy)
+	pthread_cond_wait(&pool->cond, &pool->lock);
+      if (!pool->queue)
+	break;
+      job = pool->queue;
+      pool->queue = job->next;
+      pthread_mutex_unlock(&pool->lock);
+
+      scan_job_bus(wa->a, pool, job);
+
+      pthread_mutex_lock(&pool->lock);
+      if (!--pool->busy)
+	pthread_cond_broadcast(&pool->cond);
+    }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void
+scan_link_job(struct pci_access *a, struct scan_job *job)
+{
+  int i;
+
+  for (i = 0; i < job->num_items; i++)
+    if (job->items[i].dev)
+      pci_link_dev(a, job->items[i].dev);
+    else
+      scan_link_job(a, job->items[i].child);
+  pci_mfree(job->items);
+  pci_mfree(job);
+}
+
+static void
+scan_domains_parallel(struct pci_access *a, int *domains, int count, int threads)
+{
+  struct scan_pool pool;
+  struct scan_worker_arg wa = { a, &pool };
+  struct scan_job **roots;
+  byte *busmaps;
+  pthread_t *tids;
+  int i, started, err;
+
+  a->debug("Scanning %d domains using %d threads\n", count, threads);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  pool.queue = NULL;
+  pool.busy = count;
+
+  busmaps = pci_malloc(a, count * 256);
+  memset(busmaps, 0, count * 256);
+  roots = pci_malloc(a, count * sizeof(*roots));
+  for (i = count-1; i >= 0; i--)
+    {
+      busmaps[256*i] = 1;
+      roots[i] = scan_new_job(a, busmaps + 256*i, domains[i], 0);
+      roots[i]->next = pool.queue;
+      pool.queue = roots[i];
+    }
+
+  /* The calling thread is one of the workers */
+  tids = pci_malloc(a, threads * sizeof(pthread_t));
+  for (started = 0; started < threads - 1; started++)
+    if (err = pthread_create(&tids[started], NULL, scan_worker, &wa))
+      {
+	a->debug("Cannot create thread: %s\n", strerror(err));
+	break;
+      }
+  scan_worker(&wa);
+  for (i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+
+  for (i = 0; i < count; i++)
+    scan_link_job(a, roots[i]);
+
+  pci_mfree(tids);
+  pci_mfree(roots);
+  pci_mfree(busmaps);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lock);
+}
+
+#endif
+
+/*
+ *  Scan the given domains, using the given number of threads if the
+ *  library was built with thread support. The back end must be able to
+ *  handle concurrent reads from different devices.
+ */
+void
+pci_generic_scan_domains(struct pci_access *a, int *domains, int count, int threads UNUSED)
+{
+  int i;
+
+#ifdef PCI_HAVE_PTHREADS
+  if (threads > 1 && count > 0)
+    {
+      scan_domains_parallel(a, domains, count, threads);
+      return;
+    }
+#endif
+
+  for (i = 0; i < count; i++)
+    pci_generic_scan_domain(a, domains[i]);
+}
+
 static int
 get_hdr_type(struct pci_dev *d)
 {
@@ -276,3 +540,30 @@ pci_generic_block_write(struct pci_dev *d, int pos, byte *buf, int len)
 {
   return pci_generic_block_op(d, pos, buf, len, d->access->methods->write);
 }
+
+/*
+ *  Read the config space piecewise, stopping at the first part which
+ *  cannot be accessed: the standard header, the rest of the traditional
+ *  config space and the extended config space.
+ */
+void
+pci_generic_prefetch(struct pci_access *a, int len)
+{
+  static const int limits[] = { 64, 256, 4096 };
+  struct pci_dev *d;
+  unsigned int i;
+
+  for (d = a->devices; d; d = d->next)
+    if (d->prefetch)
+      {
+	int pos = 0;
+	for (i = 0; i < sizeof(limits) / sizeof(limits[0]) && pos < len; i++)
+	  {
+	    int end = (limits[i] < len) ? limits[i] : len;
+	    if (!d->methods->read(d, pos, d->prefetch + pos, end - pos))
+	      break;
+	    pos = end;
+	  }
+	d->prefetch_len = pos;
+      }
+}
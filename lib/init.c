@@ -443,6 +443,9 @@ static void
 pci_init_dns(struct pci_access *a)
 {
   pci_define_param(a, "net.domain", PCI_ID_DOMAIN, "DNS domain used for resolving of ID's");
+  pci_define_param(a, "net.server", "", "DNS server for parallel queries (address[:port]), default is the first system name server");
+  pci_define_param(a, "net.parallel", "16", "Maximum number of DNS queries in flight (0=resolve one by one)");
+  pci_define_param(a, "net.timeout", "5000", "Time limit for parallel DNS queries in milliseconds");
   a->id_lookup_mode = PCI_LOOKUP_CACHE;
 
   char *cache_dir = getenv("XDG_CACHE_HOME");
@@ -475,6 +478,8 @@ pci_alloc(void)
 #ifdef PCI_HAVE_HWDB
   pci_define_param(a, "hwdb.disable", "0", "Do not look up names in UDEV's HWDB if non-zero");
 #endif
+  pci_define_param(a, "names.index", "1", "Use a binary index of the ID list if non-zero");
+  pci_define_param(a, "names.lazy", "1", "Parse devices of a vendor in the ID list only when needed if non-zero");
   for (i=0; i<PCI_ACCESS_MAX; i++)
     if (pci_methods[i] && pci_methods[i]->config)
       pci_methods[i]->config(a);
@@ -566,6 +571,7 @@ pci_cleanup(struct pci_access *a)
 {
   struct pci_dev *d, *e;
 
+  pci_snapshot_close(a);
   for (d=a->devices; d; d=e)
     {
       e = d->next;
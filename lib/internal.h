@@ -68,6 +68,7 @@ struct pci_methods {
   int (*read)(struct pci_dev *, int pos, byte *buf, int len);
   int (*write)(struct pci_dev *, int pos, byte *buf, int len);
   int (*read_vpd)(struct pci_dev *, int pos, byte *buf, int len);
+  void (*prefetch)(struct pci_access *, int len);
   void (*init_dev)(struct pci_dev *);
   void (*cleanup_dev)(struct pci_dev *);
 };
@@ -75,10 +76,12 @@ struct pci_methods {
 /* generic.c */
 void pci_generic_scan_bus(struct pci_access *, byte *busmap, int domain, int bus);
 void pci_generic_scan_domain(struct pci_access *, int domain);
+void pci_generic_scan_domains(struct pci_access *, int *domains, int count, int threads);
 void pci_generic_scan(struct pci_access *);
 void pci_generic_fill_info(struct pci_dev *, unsigned int flags);
 int pci_generic_block_read(struct pci_dev *, int pos, byte *buf, int len);
 int pci_generic_block_write(struct pci_dev *, int pos, byte *buf, int len);
+void pci_generic_prefetch(struct pci_access *, int len);
 
 /* emulated.c */
 int pci_emulated_read(struct pci_dev *d, int pos, byte *buf, int len);
@@ -131,6 +134,10 @@ struct pci_property {
 
 char *pci_set_property(struct pci_dev *d, u32 key, char *value);
 
+/* snapshot.c */
+int pci_snapshot_load(struct pci_access *a, const char *path, u64 signature);
+void pci_snapshot_close(struct pci_access *a);
+
 /* params.c */
 struct pci_param *pci_define_param(struct pci_access *acc, char *param, char *val, char *help);
 int pci_set_param_internal(struct pci_access *acc, char *param, char *val, int copy);
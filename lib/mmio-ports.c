@@ -24,10 +24,20 @@ struct mmio_cache {
   void *data_map;
 };
 
+struct mmio_domain {
+  u64 addr_reg;
+  u64 data_reg;
+};
+
 struct mmio_access {
   struct mmio_cache *cache;
   struct physmem *physmem;
   long pagesize;
+  struct mmio_domain *domains;		/* Parsed from the addrs parameter at init */
+  int num_domains;
+  u64 last_addr_reg;			/* Last value written to an address register */
+  u32 last_addr_val;
+  int last_addr_valid;
 };
 
 static void
@@ -47,6 +57,7 @@ munmap_regs(struct pci_access *a)
 
   pci_mfree(macc->cache);
   macc->cache = NULL;
+  macc->last_addr_valid = 0;
 }
 
 static int
@@ -159,23 +170,59 @@ get_domain_count(const char *addrs)
   return count;
 }
 
-static int
-get_domain_addr(const char *addrs, int domain, u64 *addr_reg, u64 *data_reg)
+static void
+parse_domains(struct pci_access *a, struct mmio_access *macc, const char *addrs)
 {
   char *endptr;
+  int i;
 
-  while (domain-- > 0)
+  macc->num_domains = get_domain_count(addrs);
+  macc->domains = pci_malloc(a, macc->num_domains * sizeof(*macc->domains));
+  for (i = 0; i < macc->num_domains; i++)
     {
-      addrs = strchr(addrs, ',');
-      if (!addrs)
-        return 0;
-      addrs++;
+      macc->domains[i].addr_reg = strtoull(addrs, &endptr, 16);
+      macc->domains[i].data_reg = strtoull(endptr+1, &endptr, 16);
+      addrs = endptr + 1;
     }
+}
 
-  *addr_reg = strtoull(addrs, &endptr, 16);
-  *data_reg = strtoull(endptr+1, NULL, 16);
+/*
+ *  Select a config space dword. The address register keeps its value
+ *  between accesses, so consecutive accesses to the same dword (like
+ *  byte and word reads of the header fields) need not rewrite it.
+ */
+static void
+select_dword(struct mmio_access *macc, u64 addr_reg, volatile void *addr, u32 val)
+{
+  if (macc->last_addr_valid && macc->last_addr_reg == addr_reg && macc->last_addr_val == val)
+    return;
 
-  return 1;
+  physmem_writel(val, addr);
+  physmem_readl(addr); /* write barrier for address */
+
+  macc->last_addr_reg = addr_reg;
+  macc->last_addr_val = val;
+  macc->last_addr_valid = 1;
+}
+
+static inline u32
+conf1_addr(struct pci_dev *d, int pos)
+{
+  return 0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc);
+}
+
+static int
+map_domain(struct pci_dev *d, volatile void **addr, volatile void **data, u64 *addr_reg)
+{
+  struct mmio_access *macc = d->access->backend_data;
+  struct mmio_domain *dom;
+
+  if (d->domain < 0 || d->domain >= macc->num_domains)
+    return 0;
+
+  dom = &macc->domains[d->domain];
+  *addr_reg = dom->addr_reg;
+  return mmap_regs(d->access, dom->addr_reg, dom->data_reg, 0, addr, data);
 }
 
 static void
@@ -267,6 +314,8 @@ conf1_init(struct pci_access *a)
   macc->cache = NULL;
   macc->physmem = physmem;
   macc->pagesize = pagesize;
+  macc->last_addr_valid = 0;
+  parse_domains(a, macc, addrs);
   a->backend_data = macc;
 }
 
@@ -277,55 +326,61 @@ conf1_cleanup(struct pci_access *a)
 
   munmap_regs(a);
   physmem_close(macc->physmem);
+  pci_mfree(macc->domains);
   pci_mfree(macc);
 }
 
 static void
 conf1_scan(struct pci_access *a)
 {
-  char *addrs_param_name = get_addrs_param_name(a);
-  char *addrs = pci_get_param(a, addrs_param_name);
-  int domain_count = get_domain_count(addrs);
+  struct mmio_access *macc = a->backend_data;
   int domain;
 
-  for (domain = 0; domain < domain_count; domain++)
+  for (domain = 0; domain < macc->num_domains; domain++)
     pci_generic_scan_domain(a, domain);
 }
 
 static int
 conf1_ext_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  char *addrs_param_name = get_addrs_param_name(d->access);
-  char *addrs = pci_get_param(d->access, addrs_param_name);
+  struct mmio_access *macc = d->access->backend_data;
   volatile void *addr, *data;
-  u64 addr_reg, data_reg;
-
-  if (pos >= 4096)
-    return 0;
+  volatile unsigned char *reg;
+  u64 addr_reg;
+  u16 w;
+  u32 l;
 
-  if (len != 1 && len != 2 && len != 4)
-    return pci_generic_block_read(d, pos, buf, len);
-
-  if (!get_domain_addr(addrs, d->domain, &addr_reg, &data_reg))
+  if (pos >= 4096 || len > 4096 - pos)
     return 0;
 
-  if (!mmap_regs(d->access, addr_reg, data_reg, pos&3, &addr, &data))
+  if (!map_domain(d, &addr, &data, &addr_reg))
     return 0;
 
-  physmem_writel(0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc), addr);
-  physmem_readl(addr); /* write barrier for address */
-
-  switch (len)
+  /*
+   *  Blocks are split to the same naturally aligned accesses as done by
+   *  pci_generic_block_read(), but the domain is looked up only once.
+   */
+  while (len > 0)
     {
-    case 1:
-      buf[0] = physmem_readb(data);
-      break;
-    case 2:
-      ((u16 *) buf)[0] = physmem_readw(data);
-      break;
-    case 4:
-      ((u32 *) buf)[0] = physmem_readl(data);
-      break;
+      select_dword(macc, addr_reg, addr, conf1_addr(d, pos));
+      reg = (volatile unsigned char *)data + (pos & 3);
+      if ((pos & 1) || len < 2)
+        {
+          *buf = physmem_readb(reg);
+          pos++; buf++; len--;
+        }
+      else if ((pos & 2) || len < 4)
+        {
+          w = physmem_readw(reg);
+          memcpy(buf, &w, 2);
+          pos += 2; buf += 2; len -= 2;
+        }
+      else
+        {
+          l = physmem_readl(reg);
+          memcpy(buf, &l, 4);
+          pos += 4; buf += 4; len -= 4;
+        }
     }
 
   return 1;
@@ -334,7 +389,7 @@ conf1_ext_read(struct pci_dev *d, int pos, byte *buf, int len)
 static int
 conf1_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  if (pos >= 256)
+  if (pos >= 256 || len > 256 - pos)
     return 0;
 
   return conf1_ext_read(d, pos, buf, len);
@@ -343,10 +398,9 @@ conf1_read(struct pci_dev *d, int pos, byte *buf, int len)
 static int
 conf1_ext_write(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  char *addrs_param_name = get_addrs_param_name(d->access);
-  char *addrs = pci_get_param(d->access, addrs_param_name);
+  struct mmio_access *macc = d->access->backend_data;
   volatile void *addr, *data;
-  u64 addr_reg, data_reg;
+  u64 addr_reg;
 
   if (pos >= 4096)
     return 0;
@@ -354,14 +408,11 @@ conf1_ext_write(struct pci_dev *d, int pos, byte *buf, int len)
   if (len != 1 && len != 2 && len != 4)
     return pci_generic_block_write(d, pos, buf, len);
 
-  if (!get_domain_addr(addrs, d->domain, &addr_reg, &data_reg))
+  if (!map_domain(d, &addr, &data, &addr_reg))
     return 0;
 
-  if (!mmap_regs(d->access, addr_reg, data_reg, pos&3, &addr, &data))
-    return 0;
-
-  physmem_writel(0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc), addr);
-  physmem_readl(addr); /* write barrier for address */
+  select_dword(macc, addr_reg, addr, conf1_addr(d, pos));
+  data = (volatile unsigned char *)data + (pos & 3);
 
   switch (len)
     {
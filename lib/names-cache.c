@@ -22,7 +22,34 @@
 #include <pwd.h>
 #include <unistd.h>
 
-static const char cache_version[] = "#PCI-CACHE-1.0";
+/*
+ *  The cache is a binary file with fixed-size records followed by a table
+ *  of NUL-terminated names. It is written to a temporary file and renamed
+ *  into place, so it can be simply mapped when loading. The header remembers
+ *  size and modification time of the ID list, because a cache created with
+ *  a different version of the list is stale. All numbers are in host byte
+ *  order, the version doubles as a byte order check.
+ */
+
+#define CACHE_MAGIC "PCI-NCH\n"
+#define CACHE_VERSION 2
+
+struct cache_header {
+  char magic[8];
+  u32 version;
+  u32 count;				/* Number of records */
+  u64 list_size;			/* Size of the ID list */
+  u64 list_mtime;			/* Modification time of the ID list */
+  u32 names_size;			/* Size of the name table */
+  u32 reserved;
+};
+
+struct cache_record {
+  u32 id12, id34;
+  u32 name;				/* Offset in the name table */
+  byte cat;
+  byte reserved[3];
+};
 
 static char *get_cache_name(struct pci_access *a)
 {
@@ -100,10 +127,13 @@ static void create_parent_dirs(struct pci_access *a, char *name)
 int
 pci_id_cache_load(struct pci_access *a, int flags)
 {
-  char *name;
-  char line[MAX_LINE];
-  FILE *f;
-  int lino;
+  struct cache_header *hdr;
+  struct cache_record *rec;
+  char *name, *names;
+  u64 list_size = 0, list_mtime = 0;
+  size_t len;
+  void *map;
+  u32 i;
 
   if (a->id_cache_status > 0)
     return 0;
@@ -121,51 +151,43 @@ pci_id_cache_load(struct pci_access *a, int flags)
       return 0;
     }
 
-  f = fopen(name, "rb");
-  if (!f)
+  map = pci_id_map_file(a, name, &len);
+  if (!map)
     {
       a->debug("Cache file does not exist\n");
       return 0;
     }
-  /* FIXME: Compare timestamp with the pci.ids file? */
 
-  lino = 0;
-  while (fgets(line, sizeof(line), f))
+  hdr = map;
+  if (len < sizeof(*hdr) || memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) || hdr->version != CACHE_VERSION)
     {
-      char *p = strchr(line, '\n');
-      lino++;
-      if (p)
-        {
-	  *p = 0;
-	  if (lino == 1)
-	    {
-	      if (strcmp(line, cache_version))
-	        {
-		  a->debug("Unrecognized cache version %s, ignoring\n", line);
-		  break;
-		}
-	      continue;
-	    }
-	  else
-	    {
-	      int cat, id1, id2, id3, id4, cnt;
-	      if (sscanf(line, "%d%x%x%x%x%n", &cat, &id1, &id2, &id3, &id4, &cnt) >= 5)
-	        {
-		  p = line + cnt;
-		  while (*p && *p == ' ')
-		    p++;
-		  pci_id_insert(a, cat, id1, id2, id3, id4, p, SRC_CACHE);
-		  continue;
-		}
-	    }
-	}
-      a->warning("Malformed cache file %s (line %d), ignoring", name, lino);
-      break;
+      a->debug("Unrecognized cache format, ignoring\n");
+      goto out;
+    }
+  rec = (struct cache_record *) (hdr + 1);
+  names = (char *) (rec + hdr->count);
+  if (len != sizeof(*hdr) + (size_t) hdr->count * sizeof(*rec) + hdr->names_size ||
+      (hdr->names_size && names[hdr->names_size - 1]))
+    {
+      a->warning("Malformed cache file %s, ignoring", name);
+      goto out;
+    }
+  pci_id_list_stamp(a, &list_size, &list_mtime);
+  if (hdr->list_size != list_size || hdr->list_mtime != list_mtime)
+    {
+      a->debug("Cache was created for a different ID list, ignoring\n");
+      goto out;
     }
 
-  if (ferror(f))
-    a->warning("Error while reading %s", name);
-  fclose(f);
+  for (i=0; i<hdr->count; i++)
+    if (rec[i].name < hdr->names_size)
+      pci_id_insert(a, rec[i].cat,
+		    pair_first(rec[i].id12), pair_second(rec[i].id12),
+		    pair_first(rec[i].id34), pair_second(rec[i].id34),
+		    names + rec[i].name, SRC_CACHE);
+
+out:
+  pci_id_unmap_file(map, len);
   return 1;
 }
 
@@ -174,10 +196,13 @@ pci_id_cache_flush(struct pci_access *a)
 {
   int orig_status = a->id_cache_status;
   FILE *f;
-  unsigned int h;
-  struct id_entry *e, *e2;
+  unsigned int pos, i, count;
+  struct id_entry *e, **list;
+  struct cache_header hdr;
+  struct cache_record rec;
   char hostname[256], *tmpname, *name;
   int this_pid;
+  u32 names_size;
 
   a->id_cache_status = 0;
   if (orig_status < 2)
@@ -204,29 +229,49 @@ pci_id_cache_flush(struct pci_access *a)
       return;
     }
   a->debug("Writing cache to %s\n", name);
-  fprintf(f, "%s\n", cache_version);
 
-  for (h=0; h<HASH_SIZE; h++)
-    for (e=a->id_hash[h]; e; e=e->next)
-      if (e->src == SRC_CACHE || e->src == SRC_NET)
-	{
-	  /* Negative entries are not written */
-	  if (!e->name[0])
-	    continue;
-
-	  /* Verify that every entry is written at most once */
-	  for (e2=a->id_hash[h]; e2 != e; e2=e2->next)
-	    if ((e2->src == SRC_CACHE || e2->src == SRC_NET) &&
-	        e2->cat == e->cat &&
-		e2->id12 == e->id12 && e2->id34 == e->id34)
-	    break;
-	  if (e2 == e)
-	    fprintf(f, "%d %x %x %x %x %s\n",
-	            e->cat,
-		    pair_first(e->id12), pair_second(e->id12),
-		    pair_first(e->id34), pair_second(e->id34),
-		    e->name);
-	}
+  /* Write every entry at most once: only the one which would be looked up. Negative entries are not written. */
+  count = 0;
+  pos = 0;
+  while (e = pci_id_hash_next(a, &pos))
+    if ((e->src == SRC_CACHE || e->src == SRC_NET) && e->name[0])
+      count++;
+  list = pci_malloc(a, (count ? count : 1) * sizeof(*list));
+  count = 0;
+  names_size = 0;
+  pos = 0;
+  while (e = pci_id_hash_next(a, &pos))
+    if ((e->src == SRC_CACHE || e->src == SRC_NET) && e->name[0] &&
+	pci_id_lookup(a, PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_CACHE | PCI_LOOKUP_NETWORK, e->cat,
+		      pair_first(e->id12), pair_second(e->id12),
+		      pair_first(e->id34), pair_second(e->id34)) == e->name)
+      {
+	list[count++] = e;
+	names_size += strlen(e->name) + 1;
+      }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = CACHE_VERSION;
+  hdr.count = count;
+  pci_id_list_stamp(a, &hdr.list_size, &hdr.list_mtime);
+  hdr.names_size = names_size;
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  memset(&rec, 0, sizeof(rec));
+  names_size = 0;
+  for (i=0; i<count; i++)
+    {
+      rec.id12 = list[i]->id12;
+      rec.id34 = list[i]->id34;
+      rec.cat = list[i]->cat;
+      rec.name = names_size;
+      names_size += strlen(list[i]->name) + 1;
+      fwrite(&rec, sizeof(rec), 1, f);
+    }
+  for (i=0; i<count; i++)
+    fwrite(list[i]->name, strlen(list[i]->name) + 1, 1, f);
+  pci_mfree(list);
 
   fflush(f);
   if (ferror(f))
@@ -29,17 +29,34 @@ union id_align {
 #endif
 #define BUCKET_ALIGN(n) ((n)+BUCKET_ALIGNMENT-(n)%BUCKET_ALIGNMENT)
 
+/*
+ *  The hash table uses open addressing with linear probing. Each slot
+ *  remembers the full hash value, so most mismatches are resolved without
+ *  touching the entry itself. The table doubles when it becomes 2/3 full.
+ *  There can be several entries with the same key, which come from
+ *  different sources.
+ */
+
+struct id_slot {
+  u32 hash;
+  struct id_entry *entry;
+};
+
+struct id_hash {
+  struct id_slot *slots;
+  unsigned int size;			/* Always a power of two */
+  unsigned int count;
+  unsigned long lookups, lookup_probes;	/* Statistics for debugging */
+  unsigned long inserts, insert_probes;
+};
+
+#define ID_HASH_INITIAL_SIZE 1024
+
 static void *id_alloc(struct pci_access *a, unsigned int size)
 {
   struct id_bucket *buck = a->current_id_bucket;
   unsigned int pos;
 
-  if (!a->id_hash)
-    {
-      a->id_hash = pci_malloc(a, sizeof(struct id_entry *) * HASH_SIZE);
-      memset(a->id_hash, 0, sizeof(struct id_entry *) * HASH_SIZE);
-    }
-
   if (!buck || buck->full + size > BUCKET_SIZE)
     {
       buck = pci_malloc(a, BUCKET_SIZE);
@@ -52,66 +69,187 @@ static void *id_alloc(struct pci_access *a, unsigned int size)
   return (byte *)buck + pos;
 }
 
-static inline unsigned int id_hash(int cat, u32 id12, u32 id34)
+static inline u32 id_hash(int cat, u32 id12, u32 id34)
 {
-  unsigned int h;
+  u32 h = id12 * 0x9e3779b1 + id34 * 0x85ebca77 + cat;
 
-  h = id12 ^ (id34 << 3) ^ (cat << 5);
-  return h % HASH_SIZE;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6d;
+  h ^= h >> 12;
+  h *= 0x297a2d39;
+  h ^= h >> 15;
+  return h;
 }
 
-int
-pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, enum id_entry_src src)
+static void id_hash_resize(struct pci_access *a, unsigned int size)
+{
+  struct id_hash *t = a->id_hash;
+  struct id_slot *old = t->slots;
+  unsigned int old_size = t->size;
+  unsigned int i, j;
+
+  t->slots = pci_malloc(a, size * sizeof(struct id_slot));
+  memset(t->slots, 0, size * sizeof(struct id_slot));
+  t->size = size;
+  for (i=0; i<old_size; i++)
+    if (old[i].entry)
+      {
+	j = old[i].hash & (size - 1);
+	while (t->slots[j].entry)
+	  j = (j + 1) & (size - 1);
+	t->slots[j] = old[i];
+      }
+  pci_mfree(old);
+}
+
+static inline int id_match(struct id_entry *e, int cat, u32 id12, u32 id34)
+{
+  return e->id12 == id12 && e->id34 == id34 && e->cat == cat;
+}
+
+static int
+id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, unsigned int len, enum id_entry_src src, int copy)
 {
   u32 id12 = id_pair(id1, id2);
   u32 id34 = id_pair(id3, id4);
-  unsigned int h = id_hash(cat, id12, id34);
-  struct id_entry *n = a->id_hash ? a->id_hash[h] : NULL;
-  int len = strlen(text);
-
-  while (n && (n->id12 != id12 || n->id34 != id34 || n->cat != cat))
-    n = n->next;
-  if (n)
-    return 1;
-  n = id_alloc(a, sizeof(struct id_entry) + len);
+  u32 h = id_hash(cat, id12, id34);
+  struct id_hash *t = a->id_hash;
+  struct id_entry *n;
+  unsigned int i;
+
+  if (!t)
+    {
+      t = a->id_hash = pci_malloc(a, sizeof(struct id_hash));
+      memset(t, 0, sizeof(*t));
+      id_hash_resize(a, ID_HASH_INITIAL_SIZE);
+    }
+  else if (3 * (t->count + 1) > 2 * t->size)
+    id_hash_resize(a, 2 * t->size);
+
+  /* An entry from a source of higher priority may override an existing one */
+  t->inserts++;
+  for (i = h & (t->size - 1); n = t->slots[i].entry; i = (i + 1) & (t->size - 1))
+    {
+      t->insert_probes++;
+      if (t->slots[i].hash == h && id_match(n, cat, id12, id34) && n->src >= src)
+	return 1;
+    }
+
+  if (copy)
+    {
+      n = id_alloc(a, sizeof(struct id_entry) + len + 1);
+      n->name = (char *) (n + 1);
+      memcpy(n->name, text, len);
+      n->name[len] = 0;
+      n->terminated = 1;
+    }
+  else
+    {
+      n = id_alloc(a, sizeof(struct id_entry));
+      n->name = text;
+      n->terminated = 0;
+    }
+  n->len = len;
   n->id12 = id12;
   n->id34 = id34;
   n->cat = cat;
   n->src = src;
-  memcpy(n->name, text, len+1);
-  n->next = a->id_hash[h];
-  a->id_hash[h] = n;
+  t->slots[i].hash = h;
+  t->slots[i].entry = n;
+  t->count++;
   return 0;
 }
 
+int
+pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, enum id_entry_src src)
+{
+  return id_insert(a, cat, id1, id2, id3, id4, text, strlen(text), src, 1);
+}
+
+/*
+ *  Like pci_id_insert(), but the name is given by its start and length and it
+ *  is not copied, so it must stay valid until the hash is freed. It need not
+ *  be terminated, a terminated copy is made when the entry is looked up.
+ */
+int
+pci_id_insert_ref(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, unsigned int len, enum id_entry_src src)
+{
+  return id_insert(a, cat, id1, id2, id3, id4, text, len, src, 0);
+}
+
 char
 *pci_id_lookup(struct pci_access *a, int flags, int cat, int id1, int id2, int id3, int id4)
 {
+  struct id_hash *t = a->id_hash;
   struct id_entry *n, *best;
   u32 id12 = id_pair(id1, id2);
   u32 id34 = id_pair(id3, id4);
+  u32 h;
+  unsigned int i;
 
-  if (a->id_hash)
+  if (!(flags & PCI_LOOKUP_SKIP_LOCAL))
     {
-      n = a->id_hash[id_hash(cat, id12, id34)];
-      best = NULL;
-      for (; n; n=n->next)
-        {
-	  if (n->id12 != id12 || n->id34 != id34 || n->cat != cat)
-	    continue;
-	  if (n->src == SRC_LOCAL && (flags & PCI_LOOKUP_SKIP_LOCAL))
-	    continue;
-	  if (n->src == SRC_NET && !(flags & PCI_LOOKUP_NETWORK))
-	    continue;
-	  if (n->src == SRC_CACHE && !(flags & PCI_LOOKUP_CACHE))
-	    continue;
-	  if (n->src == SRC_HWDB && (flags & (PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_NO_HWDB)))
-	    continue;
-	  if (!best || best->src < n->src)
-	    best = n;
+      /* Local entries from the index take precedence over everything in the hash */
+      if (a->id_index)
+	{
+	  char *name = pci_id_index_lookup(a, cat, id1, id2, id3, id4);
+	  if (name)
+	    return name;
 	}
-      if (best)
-	return best->name;
+
+      /* Devices and subsystems of a vendor might not have been parsed yet */
+      if (a->id_text && (cat == ID_DEVICE || cat == ID_SUBSYSTEM))
+	pci_id_parse_vendor(a, id1);
+    }
+
+  if (!t)
+    return NULL;
+
+  h = id_hash(cat, id12, id34);
+  best = NULL;
+  t->lookups++;
+  for (i = h & (t->size - 1); n = t->slots[i].entry; i = (i + 1) & (t->size - 1))
+    {
+      t->lookup_probes++;
+      if (t->slots[i].hash != h || !id_match(n, cat, id12, id34))
+	continue;
+      if (n->src == SRC_LOCAL && (flags & PCI_LOOKUP_SKIP_LOCAL))
+	continue;
+      if (n->src == SRC_NET && !(flags & PCI_LOOKUP_NETWORK))
+	continue;
+      if (n->src == SRC_CACHE && !(flags & PCI_LOOKUP_CACHE))
+	continue;
+      if (n->src == SRC_HWDB && (flags & (PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_NO_HWDB)))
+	continue;
+      if (!best || best->src < n->src)
+	best = n;
+    }
+  if (!best)
+    return NULL;
+  if (!best->terminated)
+    {
+      char *name = id_alloc(a, best->len + 1);
+      memcpy(name, best->name, best->len);
+      name[best->len] = 0;
+      best->name = name;
+      best->terminated = 1;
+    }
+  return best->name;
+}
+
+/* Iterate over all entries in the hash, *pos should start at 0 */
+struct id_entry *
+pci_id_hash_next(struct pci_access *a, unsigned int *pos)
+{
+  struct id_hash *t = a->id_hash;
+
+  if (!t)
+    return NULL;
+  while (*pos < t->size)
+    {
+      struct id_entry *e = t->slots[(*pos)++].entry;
+      if (e)
+	return e;
     }
   return NULL;
 }
@@ -119,8 +257,18 @@ char
 void
 pci_id_hash_free(struct pci_access *a)
 {
-  pci_mfree(a->id_hash);
-  a->id_hash = NULL;
+  struct id_hash *t = a->id_hash;
+
+  if (t)
+    {
+      a->debug("ID hash: %u entries in %u slots (%u%% full), %.2f probes per insert, %.2f per lookup\n",
+	       t->count, t->size, 100 * t->count / t->size,
+	       t->inserts ? (double) t->insert_probes / t->inserts : 0.,
+	       t->lookups ? (double) t->lookup_probes / t->lookups : 0.);
+      pci_mfree(t->slots);
+      pci_mfree(t);
+      a->id_hash = NULL;
+    }
   while (a->current_id_bucket)
     {
       struct id_bucket *buck = a->current_id_bucket;
@@ -0,0 +1,335 @@
+/*
+ *	The PCI Library -- Binary Index of the ID List
+ *
+ *	Copyright (c) 2026 The PCI Utilities contributors
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "names.h"
+
+#ifdef PCI_HAVE_MMAP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ *  The index is a sorted array of fixed-size entries followed by a table
+ *  of NUL-terminated names. It is stored next to the ID list (pci.ids.idx
+ *  for both pci.ids and pci.ids.gz) and it remembers size and modification
+ *  time of the list it was generated from, so that a stale index is never
+ *  used. All numbers are in host byte order, the version field doubles as
+ *  a byte order check.
+ */
+
+#define INDEX_MAGIC "PCI-IDX\n"
+#define INDEX_VERSION 1
+
+struct id_index_header {
+  char magic[8];
+  u32 version;
+  u32 count;				/* Number of entries */
+  u64 src_size;				/* Size of the ID list */
+  u64 src_mtime;			/* Modification time of the ID list */
+  u32 names_size;			/* Size of the name table */
+  u32 reserved;
+};
+
+struct id_index_entry {
+  u32 id12, id34;
+  u32 name;				/* Offset in the name table */
+  byte cat;
+  byte reserved[3];
+};
+
+struct id_index {
+  void *map;
+  size_t map_len;
+  struct id_index_entry *entries;
+  u32 count;
+  char *names;
+  u32 names_size;
+};
+
+static char *
+index_name(struct pci_access *a)
+{
+  char *src = a->id_file_name;
+  int len = strlen(src);
+  char *name;
+
+  if (len >= 3 && !strcmp(src + len - 3, ".gz"))
+    len -= 3;
+  name = pci_malloc(a, len + 5);
+  memcpy(name, src, len);
+  strcpy(name + len, ".idx");
+  return name;
+}
+
+static int
+index_enabled(struct pci_access *a)
+{
+  char *enabled = pci_get_param(a, "names.index");
+  return enabled && atoi(enabled);
+}
+
+int
+pci_id_index_load(struct pci_access *a)
+{
+  struct id_index_header *hdr;
+  struct id_index *idx;
+  u64 src_size, src_mtime;
+  size_t len;
+  void *map;
+  char *name;
+
+  if (!index_enabled(a) || !pci_id_list_stamp(a, &src_size, &src_mtime))
+    return 0;
+
+  name = index_name(a);
+  map = pci_id_map_file(a, name, &len);
+  if (!map)
+    {
+      a->debug("Index %s not available\n", name);
+      pci_mfree(name);
+      return 0;
+    }
+
+  hdr = map;
+  if (len < sizeof(*hdr) ||
+      memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != INDEX_VERSION ||
+      hdr->count > (len - sizeof(*hdr)) / sizeof(struct id_index_entry) ||
+      hdr->names_size != len - sizeof(*hdr) - (size_t) hdr->count * sizeof(struct id_index_entry) ||
+      !hdr->names_size ||
+      ((char *) map)[len - 1])		/* The name table must end with a NUL */
+    {
+      a->debug("Index %s is invalid, ignoring\n", name);
+      goto fail;
+    }
+  if (hdr->src_size != src_size || hdr->src_mtime != src_mtime)
+    {
+      a->debug("Index %s is stale, ignoring\n", name);
+      goto fail;
+    }
+
+  idx = pci_malloc(a, sizeof(*idx));
+  idx->map = map;
+  idx->map_len = len;
+  idx->count = hdr->count;
+  idx->entries = (struct id_index_entry *) (hdr + 1);
+  idx->names = (char *) (idx->entries + idx->count);
+  idx->names_size = hdr->names_size;
+  a->id_index = idx;
+  a->debug("Using index %s with %u entries\n", name, idx->count);
+  pci_mfree(name);
+  return 1;
+
+fail:
+  pci_id_unmap_file(map, len);
+  pci_mfree(name);
+  return 0;
+}
+
+static inline int
+index_cmp(int cat, u32 id12, u32 id34, byte ecat, u32 eid12, u32 eid34)
+{
+  if (cat != ecat)
+    return (cat < ecat) ? -1 : 1;
+  if (id12 != eid12)
+    return (id12 < eid12) ? -1 : 1;
+  if (id34 != eid34)
+    return (id34 < eid34) ? -1 : 1;
+  return 0;
+}
+
+char *
+pci_id_index_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4)
+{
+  struct id_index *idx = a->id_index;
+  u32 id12 = id_pair(id1, id2);
+  u32 id34 = id_pair(id3, id4);
+  u32 lo = 0, hi = idx->count;
+
+  while (lo < hi)
+    {
+      u32 mid = lo + (hi - lo) / 2;
+      struct id_index_entry *e = &idx->entries[mid];
+      int c = index_cmp(cat, id12, id34, e->cat, e->id12, e->id34);
+      if (!c)
+	return (e->name < idx->names_size) ? idx->names + e->name : NULL;
+      if (c < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  return NULL;
+}
+
+static int
+index_entry_cmp(const void *A, const void *B)
+{
+  const struct id_entry *a = *(const struct id_entry **) A;
+  const struct id_entry *b = *(const struct id_entry **) B;
+  return index_cmp(a->cat, a->id12, a->id34, b->cat, b->id12, b->id34);
+}
+
+/*
+ *  Generate the index from the local entries in the hash. Called only by
+ *  pci_write_name_index() after the whole list has been parsed, the library
+ *  never writes the index on its own.
+ */
+int
+pci_id_index_write(struct pci_access *a)
+{
+  struct id_index_header hdr;
+  struct id_index_entry ie;
+  struct id_entry **list, *e;
+  u64 src_size, src_mtime;
+  char *name, *tmpname;
+  unsigned int pos, i, count;
+  u32 names_size;
+  int fd, res = 0;
+  FILE *f;
+
+  if (!pci_id_list_stamp(a, &src_size, &src_mtime))
+    {
+      a->warning("Cannot stat %s: %s", a->id_file_name, strerror(errno));
+      return 0;
+    }
+
+  name = index_name(a);
+  tmpname = pci_malloc(a, strlen(name) + 32);
+  count = 0;
+  pos = 0;
+  while (e = pci_id_hash_next(a, &pos))
+    if (e->src == SRC_LOCAL)
+      count++;
+  if (!count)
+    {
+      a->warning("No ID's found in %s", a->id_file_name);
+      goto out;
+    }
+
+  sprintf(tmpname, "%s.tmp-%d", name, (int) getpid());
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0 || !(f = fdopen(fd, "wb")))
+    {
+      a->warning("Cannot create %s: %s", tmpname, strerror(errno));
+      if (fd >= 0)
+	{
+	  close(fd);
+	  unlink(tmpname);
+	}
+      goto out;
+    }
+  a->debug("Writing index %s\n", name);
+
+  list = pci_malloc(a, count * sizeof(*list));
+  i = 0;
+  names_size = 0;
+  pos = 0;
+  while (e = pci_id_hash_next(a, &pos))
+    if (e->src == SRC_LOCAL)
+      {
+	list[i++] = e;
+	names_size += e->len + 1;
+      }
+  qsort(list, count, sizeof(*list), index_entry_cmp);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = INDEX_VERSION;
+  hdr.count = count;
+  hdr.src_size = src_size;
+  hdr.src_mtime = src_mtime;
+  hdr.names_size = names_size;
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  memset(&ie, 0, sizeof(ie));
+  names_size = 0;
+  for (i=0; i<count; i++)
+    {
+      ie.id12 = list[i]->id12;
+      ie.id34 = list[i]->id34;
+      ie.cat = list[i]->cat;
+      ie.name = names_size;
+      names_size += list[i]->len + 1;
+      fwrite(&ie, sizeof(ie), 1, f);
+    }
+  for (i=0; i<count; i++)
+    {
+      /* Names referring to the ID list are not terminated */
+      fwrite(list[i]->name, list[i]->len, 1, f);
+      putc(0, f);
+    }
+  pci_mfree(list);
+
+  fflush(f);
+  if (ferror(f))
+    {
+      a->warning("Error writing %s", tmpname);
+      fclose(f);
+      unlink(tmpname);
+      goto out;
+    }
+  fclose(f);
+
+  if (rename(tmpname, name) < 0)
+    {
+      a->warning("Cannot rename %s to %s: %s", tmpname, name, strerror(errno));
+      unlink(tmpname);
+    }
+  else
+    res = 1;
+
+out:
+  pci_mfree(tmpname);
+  pci_mfree(name);
+  return res;
+}
+
+void
+pci_id_index_free(struct pci_access *a)
+{
+  struct id_index *idx = a->id_index;
+
+  if (idx)
+    {
+      pci_id_unmap_file(idx->map, idx->map_len);
+      pci_mfree(idx);
+      a->id_index = NULL;
+    }
+}
+
+#else
+
+int pci_id_index_load(struct pci_access *a UNUSED)
+{
+  return 0;
+}
+
+char *pci_id_index_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED)
+{
+  return NULL;
+}
+
+int pci_id_index_write(struct pci_access *a)
+{
+  a->warning("Binary index of the ID list is not supported");
+  return 0;
+}
+
+void pci_id_index_free(struct pci_access *a UNUSED)
+{
+}
+
+#endif
@@ -25,7 +25,14 @@
 #undef BYTE_ORDER
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <netdb.h>
@@ -158,19 +165,14 @@ err:
   return -1;
 }
 
-char
-*pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4)
+static int
+dns_query_name(struct pci_access *a, char *dnsname, int cat, int id1, int id2, int id3, int id4)
 {
-  static int resolver_inited;
-  char name[256], dnsname[256], txt[256], *domain;
-  byte answer[4096];
-  const byte *data;
-  int res, j, dlen;
-  struct dns_state ds;
+  char name[256], *domain;
 
   domain = pci_get_param(a, "net.domain");
   if (!domain || !domain[0])
-    return NULL;
+    return 0;
 
   switch (cat)
     {
@@ -196,23 +198,60 @@ char
       sprintf(name, "%02x.%02x.%02x.c", id3, id2, id1);
       break;
     default:
-      return NULL;
+      return 0;
     }
   sprintf(dnsname, "%.100s.%.100s", name, domain);
+  return 1;
+}
+
+/* Parse the net.server parameter, returns 0 if not set, -1 if invalid */
+static int
+dns_server_param(struct pci_access *a, struct sockaddr_in *sin)
+{
+  char *server = pci_get_param(a, "net.server");
+  char addr[64], *colon;
+
+  if (!server || !server[0])
+    return 0;
+  snprintf(addr, sizeof(addr), "%s", server);
+  memset(sin, 0, sizeof(*sin));
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(53);
+  if (colon = strchr(addr, ':'))
+    {
+      *colon++ = 0;
+      sin->sin_port = htons(atoi(colon));
+    }
+  if (inet_pton(AF_INET, addr, &sin->sin_addr) != 1)
+    {
+      a->warning("Invalid DNS server address %s", server);
+      return -1;
+    }
+  return 1;
+}
+
+static void
+dns_init(void)
+{
+  static int resolver_inited;
 
-  a->debug("Resolving %s\n", dnsname);
   if (!resolver_inited)
     {
       resolver_inited = 1;
       res_init();
     }
-  res = res_query(dnsname, ns_c_in, ns_t_txt, answer, sizeof(answer));
-  if (res < 0)
-    {
-      a->debug("\tfailed, h_errno=%d\n", h_errno);
-      return NULL;
-    }
-  if (dns_parse_packet(&ds, answer, res) < 0)
+}
+
+/* Extract the name from TXT records in the answer */
+static char *
+dns_parse_answer(struct pci_access *a, byte *answer, int len)
+{
+  char txt[256];
+  const byte *data;
+  int j, dlen;
+  struct dns_state ds;
+
+  if (dns_parse_packet(&ds, answer, len) < 0)
     {
       a->debug("\tMalformed DNS packet received\n");
       return NULL;
@@ -242,6 +281,227 @@ char
   return NULL;
 }
 
+char
+*pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4)
+{
+  char dnsname[256];
+  byte answer[4096];
+  int res;
+
+  if (!dns_query_name(a, dnsname, cat, id1, id2, id3, id4))
+    return NULL;
+
+  a->debug("Resolving %s\n", dnsname);
+  dns_init();
+  res = res_query(dnsname, ns_c_in, ns_t_txt, answer, sizeof(answer));
+  if (res < 0)
+    {
+      a->debug("\tfailed, h_errno=%d\n", h_errno);
+      return NULL;
+    }
+  return dns_parse_answer(a, answer, res);
+}
+
+/*
+ *  Batched resolving: all queries are sent over a single UDP socket to one
+ *  name server, at most net.parallel of them are in flight at once and
+ *  unanswered ones are retransmitted every second until net.timeout expires.
+ *  Truncated answers and queries which timed out are repeated by the ordinary
+ *  resolver, which can use TCP and other name servers.
+ *  If we cannot talk to the server directly, we resolve the names one by one.
+ */
+
+#define DNS_RETRANSMIT_MS 1000
+
+enum dns_query_state {
+  DNS_Q_WAITING,
+  DNS_Q_SENT,
+  DNS_Q_DONE,
+  DNS_Q_FALLBACK,
+};
+
+struct dns_query {
+  byte packet[512];
+  int len;
+  int state;
+  long sent;				/* Time of the last transmission */
+};
+
+static long
+dns_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+static int
+dns_open_server(struct pci_access *a)
+{
+  struct sockaddr_in sin;
+  int fd;
+
+  /* The configuration of the resolver belongs to the application, so it is never modified */
+  if (dns_server_param(a, &sin) <= 0)
+    {
+      dns_init();
+      if (_res.nscount < 1 || _res.nsaddr_list[0].sin_family != AF_INET)
+	{
+	  a->debug("No IPv4 name server configured\n");
+	  return -1;
+	}
+      sin = _res.nsaddr_list[0];
+    }
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* Returns 0 if the query cannot be sent, it is then left to the ordinary resolver */
+static int
+dns_send(int fd, struct dns_query *dq, long now)
+{
+  if (send(fd, dq->packet, dq->len, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      dq->state = DNS_Q_FALLBACK;
+      return 0;
+    }
+  dq->state = DNS_Q_SENT;
+  dq->sent = now;
+  return 1;
+}
+
+void
+pci_id_net_lookup_batch(struct pci_access *a, struct id_net_query *q, int n)
+{
+  int window = atoi(pci_get_param(a, "net.parallel"));
+  int timeout = atoi(pci_get_param(a, "net.timeout"));
+  struct dns_query *dqs;
+  char dnsname[256];
+  byte answer[4096];
+  int fd, i, len, next, in_flight, pending;
+  long now, deadline;
+  u16 base_id;
+
+  fd = (window > 1) ? dns_open_server(a) : -1;
+  if (fd < 0)
+    {
+      for (i=0; i<n; i++)
+	q[i].name = pci_id_net_lookup(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4);
+      return;
+    }
+
+  dqs = pci_malloc(a, n * sizeof(struct dns_query));
+  base_id = (getpid() ^ dns_now()) & 0xffff;
+  pending = 0;
+  for (i=0; i<n; i++)
+    {
+      struct dns_query *dq = &dqs[i];
+      dq->state = DNS_Q_DONE;
+      dq->len = -1;
+      q[i].name = NULL;
+      if (dns_query_name(a, dnsname, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4))
+	{
+	  a->debug("Resolving %s\n", dnsname);
+	  dq->len = res_mkquery(ns_o_query, dnsname, ns_c_in, ns_t_txt, NULL, 0, NULL, dq->packet, sizeof(dq->packet));
+	}
+      if (dq->len < 12)
+	continue;
+      dq->packet[0] = (base_id + i) >> 8;
+      dq->packet[1] = (base_id + i) & 0xff;
+      dq->state = DNS_Q_WAITING;
+      pending++;
+    }
+
+  now = dns_now();
+  deadline = now + timeout;
+  next = in_flight = 0;
+  while (pending && now < deadline)
+    {
+      struct pollfd pfd;
+      long wait = deadline - now;
+
+      while (next < n && in_flight < window)
+	{
+	  if (dqs[next].state == DNS_Q_WAITING)
+	    {
+	      if (dns_send(fd, &dqs[next], now))
+		in_flight++;
+	      else
+		pending--;
+	    }
+	  next++;
+	}
+      for (i=0; i<next; i++)
+	if (dqs[i].state == DNS_Q_SENT)
+	  {
+	    if (now - dqs[i].sent >= DNS_RETRANSMIT_MS && !dns_send(fd, &dqs[i], now))
+	      {
+		in_flight--;
+		pending--;
+		continue;
+	      }
+	    if (dqs[i].sent + DNS_RETRANSMIT_MS - now < wait)
+	      wait = dqs[i].sent + DNS_RETRANSMIT_MS - now;
+	  }
+      if (!pending)
+	break;
+
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, (wait > 0) ? wait : 0) < 0 && errno != EINTR)
+	break;
+
+      while ((len = recv(fd, answer, sizeof(answer), 0)) >= 12)
+	{
+	  struct dns_query *dq;
+	  i = (u16)(((answer[0] << 8) | answer[1]) - base_id);
+	  if (i >= n)
+	    continue;
+	  dq = &dqs[i];
+	  /* The answer must repeat our question */
+	  if (dq->state != DNS_Q_SENT || len < dq->len || memcmp(answer + 12, dq->packet + 12, dq->len - 12))
+	    continue;
+	  if (answer[2] & 0x02)
+	    dq->state = DNS_Q_FALLBACK;
+	  else
+	    {
+	      dq->state = DNS_Q_DONE;
+	      if ((answer[3] & 0x0f) == ns_r_noerror)
+		q[i].name = dns_parse_answer(a, answer, len);
+	    }
+	  in_flight--;
+	  pending--;
+	}
+      if (len < 0 && errno == ECONNREFUSED)
+	{
+	  /* Nobody listens there, leave the rest to the ordinary resolver */
+	  for (i=0; i<n; i++)
+	    if (dqs[i].state == DNS_Q_WAITING || dqs[i].state == DNS_Q_SENT)
+	      dqs[i].state = DNS_Q_FALLBACK;
+	  pending = 0;
+	  break;
+	}
+      now = dns_now();
+    }
+  close(fd);
+
+  if (pending)
+    a->debug("DNS queries timed out, %d names left to the resolver\n", pending);
+  for (i=0; i<n; i++)
+    if (dqs[i].state != DNS_Q_DONE)
+      q[i].name = pci_id_net_lookup(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4);
+  pci_mfree(dqs);
+}
+
 #else
 
 char *pci_id_net_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED)
@@ -249,4 +509,8 @@ char *pci_id_net_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNU
   return NULL;
 }
 
+void pci_id_net_lookup_batch(struct pci_access *a UNUSED, struct id_net_query *q UNUSED, int n UNUSED)
+{
+}
+
 #endif
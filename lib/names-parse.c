@@ -16,11 +16,19 @@
 #include "internal.h"
 #include "names.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef PCI_HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #ifdef PCI_COMPRESSED_IDS
 #include <zlib.h>
 typedef gzFile pci_file;
-#define pci_gets(f, l, s)	gzgets(f, l, s)
-#define pci_eof(f)		gzeof(f)
+#define pci_read(f, b, n)	gzread(f, b, n)
 
 static pci_file pci_open(struct pci_access *a)
 {
@@ -52,8 +60,7 @@ static pci_file pci_open(struct pci_access *a)
 	}
 #else
 typedef FILE * pci_file;
-#define pci_gets(f, l, s)	fgets(l, s, f)
-#define pci_eof(f)		feof(f)
+#define pci_read(f, b, n)	fread(b, 1, n, f)
 #define pci_open(a)		fopen(a->id_file_name, "r")
 #define pci_close(f)		fclose(f)
 #define PCI_ERROR(f, err)	if (!err && ferror(f))	err = "I/O error";
@@ -83,33 +90,264 @@ static inline int id_white_p(int c)
   return (c == ' ') || (c == '\t');
 }
 
+static inline int id_white_at(char *p, char *eol)
+{
+  return p < eol && id_white_p(*p);
+}
+
+
+/*
+ *  The whole ID list is kept in memory. In the lazy mode, nested lines of
+ *  vendor blocks (devices and subsystems) are parsed only when a device of
+ *  the particular vendor is looked up, which is typically a small fraction
+ *  of the list. Classes and generic subsystems are always parsed at once.
+ *
+ *  The text is never modified: the hash refers to names in the text by
+ *  their start and length, without copying them. If possible, an uncompressed
+ *  list is mapped read-only to memory, otherwise it is read (and decompressed)
+ *  to a single buffer.
+ */
+
+struct id_block {
+  size_t start, end;			/* Nested lines of the block */
+  int lino;				/* Number of the vendor line */
+  u16 vendor;
+  byte parsed;
+};
+
+struct id_text {
+  char *text;
+  size_t len;
+  int mapped;				/* Text comes from pci_id_map_file() */
+  struct id_block *blocks;
+  unsigned int num_blocks, max_blocks;
+};
+
+static char *id_read_file(struct pci_access *a, pci_file f, size_t *lenp)
+{
+  size_t len = 0, size = 65536;
+  char *buf = pci_malloc(a, size);
+  int n;
+
+  while ((n = pci_read(f, buf + len, size - len - 1)) > 0)
+    {
+      len += n;
+      if (size - len < 4096)
+	{
+	  char *new = pci_malloc(a, 2*size);
+	  memcpy(new, buf, len);
+	  pci_mfree(buf);
+	  buf = new;
+	  size *= 2;
+	}
+    }
+  buf[len] = 0;
+  *lenp = len;
+  return buf;
+}
+
+#ifdef PCI_HAVE_MMAP
 
-static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
+/* Map a whole regular file to memory for reading */
+void *
+pci_id_map_file(struct pci_access *a, char *name, size_t *lenp)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size)
+    {
+      close(fd);
+      return NULL;
+    }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    {
+      a->debug("Cannot map %s: %s\n", name, strerror(errno));
+      return NULL;
+    }
+  *lenp = st.st_size;
+  return map;
+}
+
+void
+pci_id_unmap_file(void *map, size_t len)
+{
+  munmap(map, len);
+}
+
+#else
+
+void *
+pci_id_map_file(struct pci_access *a, char *name, size_t *lenp)
+{
+  FILE *f = fopen(name, "rb");
+  char *buf;
+  long len;
+
+  if (!f)
+    return NULL;
+  if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET) < 0)
+    {
+      fclose(f);
+      return NULL;
+    }
+  buf = pci_malloc(a, len);
+  if (fread(buf, 1, len, f) != (size_t) len)
+    {
+      pci_mfree(buf);
+      fclose(f);
+      return NULL;
+    }
+  fclose(f);
+  *lenp = len;
+  return buf;
+}
+
+void
+pci_id_unmap_file(void *map, size_t len UNUSED)
+{
+  pci_mfree(map);
+}
+
+#endif
+
+/* Size and modification time of the ID list, which other files derived from it refer to */
+int
+pci_id_list_stamp(struct pci_access *a, u64 *size, u64 *mtime)
+{
+  char *src = a->id_file_name;
+  int len = strlen(src);
+  struct stat st;
+  int res;
+
+  res = stat(src, &st);
+  if (res < 0 && len >= 3 && !strcmp(src + len - 3, ".gz"))
+    {
+      /* The same fallback as in pci_open() */
+      char *plain = pci_strdup(a, src);
+      plain[len - 3] = 0;
+      res = stat(plain, &st);
+      pci_mfree(plain);
+    }
+  if (res < 0)
+    return 0;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return 1;
+}
+
+static int id_map_text(struct pci_access *a, struct id_text *t)
+{
+  t->text = pci_id_map_file(a, a->id_file_name, &t->len);
+  if (!t->text)
+    return 0;
+
+  /* Compressed lists must be decompressed, the last line must be terminated */
+  if (t->len < 2 || ((byte) t->text[0] == 0x1f && (byte) t->text[1] == 0x8b) || t->text[t->len-1] != '\n')
+    {
+      pci_id_unmap_file(t->text, t->len);
+      t->text = NULL;
+      return 0;
+    }
+  t->mapped = 1;
+  a->debug("Mapped %s\n", a->id_file_name);
+  return 1;
+}
+
+/* Get the next line of the text, its end (without the line terminator) is stored to *endp */
+static char *id_get_line(struct id_text *t, size_t *pos, size_t end, char **endp)
+{
+  char *line, *eol, *p;
+
+  if (*pos >= end)
+    return NULL;
+  line = t->text + *pos;
+  eol = memchr(line, '\n', end - *pos);
+  if (eol)
+    *pos = eol - t->text + 1;
+  else
+    {
+      eol = t->text + end;		/* Read buffers are always terminated */
+      *pos = end;
+    }
+  p = line;
+  while (p < eol && *p && *p != '\r')
+    p++;
+  if (p > line && (p[-1] == ' ' || p[-1] == '\t'))
+    p--;
+  *endp = p;
+  return line;
+}
+
+/* Skip nested lines (and comments) of a block without parsing them */
+static size_t id_skip_block(struct id_text *t, size_t pos, int *lino)
 {
-  char line[MAX_LINE];
   char *p;
-  int id1=0, id2=0, id3=0, id4=0;
-  int cat = -1;
+
+  while (pos < t->len)
+    {
+      p = t->text + pos;
+      if (*p != '\t')
+	{
+	  while (id_white_p(*p))
+	    p++;
+	  if (*p && *p != '#' && *p != '\n' && *p != '\r')
+	    break;
+	}
+      p = memchr(t->text + pos, '\n', t->len - pos);
+      pos = p ? (size_t)(p - t->text + 1) : t->len;
+      (*lino)++;
+    }
+  return pos;
+}
+
+static void id_add_block(struct pci_access *a, struct id_text *t, int vendor, size_t start, size_t end, int lino)
+{
+  struct id_block *b;
+
+  if (t->num_blocks >= t->max_blocks)
+    {
+      t->max_blocks = t->max_blocks ? 2*t->max_blocks : 1024;
+      b = pci_malloc(a, t->max_blocks * sizeof(*b));
+      if (t->num_blocks)
+	memcpy(b, t->blocks, t->num_blocks * sizeof(*b));
+      pci_mfree(t->blocks);
+      t->blocks = b;
+    }
+  b = &t->blocks[t->num_blocks++];
+  b->vendor = vendor;
+  b->start = start;
+  b->end = end;
+  b->lino = lino;
+  b->parsed = 0;
+}
+
+static int id_block_cmp(const void *A, const void *B)
+{
+  const struct id_block *a = A, *b = B;
+  return (int) a->vendor - (int) b->vendor;
+}
+
+static const char *id_parse_lines(struct pci_access *a, struct id_text *t, size_t pos, size_t end, int *lino, int cat, int id1, int lazy)
+{
+  char *line, *eol, *p;
+  int id2=0, id3=0, id4=0;
   int nest;
   static const char parse_error[] = "Parse error";
 
-  *lino = 0;
-  while (pci_gets(f, line, sizeof(line)))
+  while (line = id_get_line(t, &pos, end, &eol))
     {
       (*lino)++;
       p = line;
-      while (*p && *p != '\n' && *p != '\r')
+      while (p < eol && id_white_p(*p))
 	p++;
-      if (!*p && !pci_eof(f))
-	return "Line too long";
-      *p = 0;
-      if (p > line && (p[-1] == ' ' || p[-1] == '\t'))
-	*--p = 0;
-
-      p = line;
-      while (id_white_p(*p))
-	p++;
-      if (!*p || *p == '#')
+      if (p >= eol || *p == '#')
 	continue;
 
       p = line;
@@ -119,30 +357,30 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 
       if (!nest)					/* Top-level entries */
 	{
-	  if (p[0] == 'C' && p[1] == ' ')		/* Class block */
+	  if (eol - p >= 2 && p[0] == 'C' && p[1] == ' ')		/* Class block */
 	    {
-	      if ((id1 = id_hex(p+2, 2)) < 0 || !id_white_p(p[4]))
+	      if ((id1 = id_hex(p+2, 2)) < 0 || !id_white_at(p+4, eol))
 		return parse_error;
 	      cat = ID_CLASS;
 	      p += 5;
 	    }
-	  else if (p[0] == 'S' && p[1] == ' ')
+	  else if (eol - p >= 2 && p[0] == 'S' && p[1] == ' ')
 	    {						/* Generic subsystem block */
-	      if ((id1 = id_hex(p+2, 4)) < 0 || p[6])
+	      if ((id1 = id_hex(p+2, 4)) < 0 || p+6 != eol)
 		return parse_error;
 	      if (!pci_id_lookup(a, 0, ID_VENDOR, id1, 0, 0, 0))
 		return "Vendor does not exist";
 	      cat = ID_GEN_SUBSYSTEM;
 	      continue;
 	    }
-	  else if (p[0] >= 'A' && p[0] <= 'Z' && p[1] == ' ')
+	  else if (eol - p >= 2 && p[0] >= 'A' && p[0] <= 'Z' && p[1] == ' ')
 	    {						/* Unrecognized block (RFU) */
 	      cat = ID_UNKNOWN;
 	      continue;
 	    }
 	  else						/* Vendor ID */
 	    {
-	      if ((id1 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	      if ((id1 = id_hex(p, 4)) < 0 || !id_white_at(p+4, eol))
 		return parse_error;
 	      cat = ID_VENDOR;
 	      p += 5;
@@ -157,14 +395,14 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 	  case ID_VENDOR:
 	  case ID_DEVICE:
 	  case ID_SUBSYSTEM:
-	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_at(p+4, eol))
 	      return parse_error;
 	    p += 5;
 	    cat = ID_DEVICE;
 	    id3 = id4 = 0;
 	    break;
 	  case ID_GEN_SUBSYSTEM:
-	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_at(p+4, eol))
 	      return parse_error;
 	    p += 5;
 	    id3 = id4 = 0;
@@ -172,7 +410,7 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 	  case ID_CLASS:
 	  case ID_SUBCLASS:
 	  case ID_PROGIF:
-	    if ((id2 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
+	    if ((id2 = id_hex(p, 2)) < 0 || !id_white_at(p+2, eol))
 	      return parse_error;
 	    p += 3;
 	    cat = ID_SUBCLASS;
@@ -186,7 +424,7 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 	  {
 	  case ID_DEVICE:
 	  case ID_SUBSYSTEM:
-	    if ((id3 = id_hex(p, 4)) < 0 || !id_white_p(p[4]) || (id4 = id_hex(p+5, 4)) < 0 || !id_white_p(p[9]))
+	    if ((id3 = id_hex(p, 4)) < 0 || !id_white_at(p+4, eol) || (id4 = id_hex(p+5, 4)) < 0 || !id_white_at(p+9, eol))
 	      return parse_error;
 	    p += 10;
 	    cat = ID_SUBSYSTEM;
@@ -194,7 +432,7 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 	  case ID_CLASS:
 	  case ID_SUBCLASS:
 	  case ID_PROGIF:
-	    if ((id3 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
+	    if ((id3 = id_hex(p, 2)) < 0 || !id_white_at(p+2, eol))
 	      return parse_error;
 	    p += 3;
 	    cat = ID_PROGIF;
@@ -205,41 +443,154 @@ static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
 	  }
       else						/* Nesting level 3 or more */
 	return parse_error;
-      while (id_white_p(*p))
+      while (p < eol && id_white_p(*p))
 	p++;
-      if (!*p)
+      if (p >= eol)
 	return parse_error;
-      if (pci_id_insert(a, cat, id1, id2, id3, id4, p, SRC_LOCAL))
+      if (pci_id_insert_ref(a, cat, id1, id2, id3, id4, p, eol - p, SRC_LOCAL))
 	return "Duplicate entry";
+      if (cat == ID_VENDOR && lazy)
+	{
+	  size_t block_start = pos;
+	  int block_lino = *lino;
+	  pos = id_skip_block(t, pos, lino);
+	  id_add_block(a, t, id1, block_start, pos, block_lino);
+	}
     }
   return NULL;
 }
 
-int
-pci_load_name_list(struct pci_access *a)
+static void id_text_free(struct pci_access *a)
+{
+  struct id_text *t = a->id_text;
+
+  if (t)
+    {
+      pci_mfree(t->blocks);
+      if (t->mapped)
+	pci_id_unmap_file(t->text, t->len);
+      else
+	pci_mfree(t->text);
+      pci_mfree(t);
+      a->id_text = NULL;
+    }
+}
+
+static void id_parse_block(struct pci_access *a, struct id_block *b)
 {
-  pci_file f;
-  int lino;
   const char *err;
+  int lino = b->lino;
+
+  b->parsed = 1;
+  err = id_parse_lines(a, a->id_text, b->start, b->end, &lino, ID_VENDOR, b->vendor, 0);
+  if (err)
+    a->error("%s at %s, line %d\n", err, a->id_file_name, lino);
+}
+
+void
+pci_id_parse_vendor(struct pci_access *a, int vendor)
+{
+  struct id_text *t = a->id_text;
+  unsigned int lo = 0, hi = t->num_blocks;
+
+  while (lo < hi)
+    {
+      unsigned int mid = (lo + hi) / 2;
+      struct id_block *b = &t->blocks[mid];
+      if (b->vendor == vendor)
+	{
+	  if (!b->parsed)
+	    id_parse_block(a, b);
+	  return;
+	}
+      if (b->vendor < vendor)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+}
+
+void
+pci_id_parse_all(struct pci_access *a)
+{
+  struct id_text *t = a->id_text;
+  unsigned int i;
+
+  if (!t)
+    return;
+  for (i=0; i<t->num_blocks; i++)
+    if (!t->blocks[i].parsed)
+      id_parse_block(a, &t->blocks[i]);
+}
+
+static int
+id_load_list(struct pci_access *a, int use_index)
+{
+  pci_file f;
+  struct id_text *t;
+  int lino = 0;
+  const char *err = NULL;
 
   pci_free_name_list(a);
   a->id_load_attempted = 1;
-  if (!(f = pci_open(a)))
-    return 0;
-  err = id_parse_list(a, f, &lino);
-  PCI_ERROR(f, err);
-  pci_close(f);
+  if (use_index && pci_id_index_load(a))
+    return 1;
+  t = pci_malloc(a, sizeof(*t));
+  memset(t, 0, sizeof(*t));
+  if (!id_map_text(a, t))
+    {
+      if (!(f = pci_open(a)))
+	{
+	  pci_mfree(t);
+	  return 0;
+	}
+      t->text = id_read_file(a, f, &t->len);
+      PCI_ERROR(f, err);
+      pci_close(f);
+    }
+  a->id_text = t;
+  if (!err)
+    err = id_parse_lines(a, t, 0, t->len, &lino, -1, 0, atoi(pci_get_param(a, "names.lazy")));
   if (err)
     a->error("%s at %s, line %d\n", err, a->id_file_name, lino);
+  if (t->num_blocks)
+    {
+      qsort(t->blocks, t->num_blocks, sizeof(struct id_block), id_block_cmp);
+      a->debug("Loaded %s, %u vendor blocks left for lazy parsing\n", a->id_file_name, t->num_blocks);
+    }
   return 1;
 }
 
+int
+pci_load_name_list(struct pci_access *a)
+{
+  return id_load_list(a, 1);
+}
+
+int
+pci_write_name_index(struct pci_access *a)
+{
+  int res;
+
+  if (!id_load_list(a, 0))
+    {
+      a->warning("Cannot open %s", a->id_file_name);
+      return 0;
+    }
+  pci_id_parse_all(a);
+  res = pci_id_index_write(a);
+  pci_free_name_list(a);
+  return res;
+}
+
 void
 pci_free_name_list(struct pci_access *a)
 {
   pci_id_cache_flush(a);
   pci_id_hash_free(a);
   pci_id_hwdb_free(a);
+  pci_id_index_free(a);
+  id_text_free(a);
   a->id_load_attempted = 0;
 }
 
@@ -227,3 +227,100 @@ pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
       return "<pci_lookup_name: invalid request>";
     }
 }
+
+static void
+id_want(struct pci_access *a, int flags, struct id_net_query **qp, int *np, int *maxp, int cat, int id1, int id2, int id3, int id4)
+{
+  struct id_net_query *q = *qp;
+  int i;
+
+  /* Known names (including negative answers from earlier queries) need not be resolved */
+  if (id_lookup(a, flags & ~PCI_LOOKUP_NETWORK, cat, id1, id2, id3, id4) ||
+      pci_id_lookup(a, flags, cat, id1, id2, id3, id4))
+    return;
+  for (i=0; i<*np; i++)
+    if (q[i].cat == cat && q[i].id1 == id1 && q[i].id2 == id2 && q[i].id3 == id3 && q[i].id4 == id4)
+      return;
+
+  if (*np >= *maxp)
+    {
+      *maxp = *maxp ? 2 * *maxp : 64;
+      q = pci_malloc(a, *maxp * sizeof(*q));
+      if (*np)
+	memcpy(q, *qp, *np * sizeof(*q));
+      pci_mfree(*qp);
+      *qp = q;
+    }
+  q += (*np)++;
+  q->cat = cat;
+  q->id1 = id1;
+  q->id2 = id2;
+  q->id3 = id3;
+  q->id4 = id4;
+  q->name = NULL;
+}
+
+/*
+ *  When names are resolved via DNS, pci_lookup_name() would send one query
+ *  at a time. This function collects all names of devices matching the filter
+ *  which are not known yet and resolves them in parallel, so that subsequent
+ *  lookups are answered from the hash. The `what' argument is a combination
+ *  of PCI_LOOKUP_VENDOR, _DEVICE, _CLASS, _PROGIF and _SUBSYSTEM selecting
+ *  the kinds of names the caller is going to look up.
+ */
+void
+pci_prefetch_names(struct pci_access *a, struct pci_filter *f, int what)
+{
+  int flags = a->id_lookup_mode;
+  struct id_net_query *q = NULL;
+  int n = 0, max = 0, i, resolved = 0;
+  struct pci_dev *d;
+
+  if (!(flags & PCI_LOOKUP_NETWORK) || a->numeric_ids == 1 || !what)
+    return;
+  if (!a->id_load_attempted && !(flags & PCI_LOOKUP_SKIP_LOCAL))
+    pci_load_name_list(a);
+
+  for (d=a->devices; d; d=d->next)
+    {
+      if (f && !pci_filter_match(f, d))
+	continue;
+      pci_fill_info(d, PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS);
+      if (what & (PCI_LOOKUP_VENDOR | PCI_LOOKUP_DEVICE))
+	id_want(a, flags, &q, &n, &max, ID_VENDOR, d->vendor_id, 0, 0, 0);
+      if (what & PCI_LOOKUP_DEVICE)
+	id_want(a, flags, &q, &n, &max, ID_DEVICE, d->vendor_id, d->device_id, 0, 0);
+      if (what & (PCI_LOOKUP_CLASS | PCI_LOOKUP_PROGIF))
+	{
+	  id_want(a, flags, &q, &n, &max, ID_CLASS, d->device_class >> 8, 0, 0, 0);
+	  id_want(a, flags, &q, &n, &max, ID_SUBCLASS, d->device_class >> 8, d->device_class & 0xff, 0, 0);
+	}
+      if ((what & PCI_LOOKUP_PROGIF) && (d->known_fields & PCI_FILL_CLASS_EXT))
+	id_want(a, flags, &q, &n, &max, ID_PROGIF, d->device_class >> 8, d->device_class & 0xff, d->prog_if, 0);
+      if ((what & PCI_LOOKUP_SUBSYSTEM) &&
+	  (d->known_fields & PCI_FILL_SUBSYS) && d->subsys_vendor_id && d->subsys_vendor_id != 0xffff)
+	{
+	  /* Both the specific and the generic subsystem entry are asked for at once */
+	  id_want(a, flags, &q, &n, &max, ID_VENDOR, d->subsys_vendor_id, 0, 0, 0);
+	  id_want(a, flags, &q, &n, &max, ID_SUBSYSTEM, d->vendor_id, d->device_id, d->subsys_vendor_id, d->subsys_id);
+	  id_want(a, flags, &q, &n, &max, ID_GEN_SUBSYSTEM, d->subsys_vendor_id, d->subsys_id, 0, 0);
+	}
+    }
+  if (!n)
+    return;
+
+  a->debug("Resolving %d names via DNS\n", n);
+  pci_id_net_lookup_batch(a, q, n);
+  for (i=0; i<n; i++)
+    if (q[i].name)
+      {
+	pci_id_insert(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4, q[i].name, SRC_NET);
+	pci_mfree(q[i].name);
+	resolved++;
+      }
+    else
+      pci_id_insert(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4, "", SRC_NET);
+  if (resolved)
+    pci_id_cache_dirty(a);
+  pci_mfree(q);
+}
@@ -8,16 +8,15 @@
  *	SPDX-License-Identifier: GPL-2.0-or-later
  */
 
-#define MAX_LINE 1024
-
 /* names-hash.c */
 
 struct id_entry {
-  struct id_entry *next;
   u32 id12, id34;
   byte cat;
   byte src;
-  char name[1];
+  byte terminated;			/* name[len] is a NUL */
+  unsigned int len;
+  char *name;
 };
 
 enum id_entry_type {
@@ -40,7 +39,6 @@ enum id_entry_src {
 };
 
 #define BUCKET_SIZE 8192
-#define HASH_SIZE 4099
 
 static inline u32 id_pair(unsigned int x, unsigned int y)
 {
@@ -58,7 +56,17 @@ static inline unsigned int pair_second(unsigned int x)
 }
 
 int pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, enum id_entry_src src);
+int pci_id_insert_ref(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, unsigned int len, enum id_entry_src src);
 char *pci_id_lookup(struct pci_access *a, int flags, int cat, int id1, int id2, int id3, int id4);
+struct id_entry *pci_id_hash_next(struct pci_access *a, unsigned int *pos);
+
+/* names-parse.c */
+
+void pci_id_parse_vendor(struct pci_access *a, int vendor);
+void pci_id_parse_all(struct pci_access *a);
+void *pci_id_map_file(struct pci_access *a, char *name, size_t *lenp);
+void pci_id_unmap_file(void *map, size_t len);
+int pci_id_list_stamp(struct pci_access *a, u64 *size, u64 *mtime);
 
 /* names-cache.c */
 
@@ -69,9 +77,22 @@ void pci_id_hash_free(struct pci_access *a);
 
 /* names-dns.c */
 
+struct id_net_query {
+  int cat, id1, id2, id3, id4;
+  char *name;				/* Resolved name (allocated) or NULL */
+};
+
 char *pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4);
+void pci_id_net_lookup_batch(struct pci_access *a, struct id_net_query *q, int n);
 
 /* names-hwdb.c */
 
 char *pci_id_hwdb_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4);
 void pci_id_hwdb_free(struct pci_access *a);
+
+/* names-index.c */
+
+int pci_id_index_load(struct pci_access *a);
+char *pci_id_index_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4);
+int pci_id_index_write(struct pci_access *a);
+void pci_id_index_free(struct pci_access *a);
@@ -82,7 +82,7 @@ struct pci_access {
   /* Fields used internally: */
   struct pci_methods *methods;
   struct pci_param *params;
-  struct id_entry **id_hash;		/* names.c */
+  struct id_hash *id_hash;		/* names-hash.c */
   struct id_bucket *current_id_bucket;
   int id_load_attempted;
   int id_cache_status;			/* 0=not read, 1=read, 2=dirty */
@@ -91,9 +91,12 @@ struct pci_access {
   struct udev_hwdb *id_udev_hwdb;
   int fd;				/* proc/sys: fd for config space */
   int fd_rw;				/* proc/sys: fd opened read-write */
-  int fd_vpd;				/* sys: fd for VPD */
+  int fd_vpd;				/* Unused, sysfs keeps its fds per device */
   struct pci_dev *cached_dev;		/* proc/sys: device the fds are for */
   void *backend_data;			/* Private data of the back end */
+  struct id_index *id_index;		/* names-index.c */
+  struct id_text *id_text;		/* names-parse.c */
+  struct pci_snapshot *snapshot;	/* snapshot.c */
 };
 
 /* Initialize PCI access */
@@ -176,6 +179,10 @@ struct pci_dev {
   struct pci_property *properties;	/* A linked list of extra properties */
   struct pci_cap *last_cap;		/* Last capability in the list */
   int hiding;				/* Device exists but has vendor and device ids ffff:ffff */
+  u8 *prefetch;				/* Config space read by pci_prefetch_config() */
+  int prefetch_len;
+  u8 *vpd_cache;			/* The start of VPD read so far by pci_read_vpd() */
+  int vpd_cache_len;
 };
 
 #define PCI_ADDR_IO_MASK (~(pciaddr_t) 0x3)
@@ -186,7 +193,7 @@ struct pci_dev {
 u8 pci_read_byte(struct pci_dev *, int pos) PCI_ABI;
 u16 pci_read_word(struct pci_dev *, int pos) PCI_ABI;
 u32 pci_read_long(struct pci_dev *, int pos) PCI_ABI;
-int pci_read_vpd(struct pci_dev *d, int pos, u8 *buf, int len) PCI_ABI;
+int pci_read_vpd(struct pci_dev *d, int pos, u8 *buf, int len) PCI_ABI;	/* Cached per device, reading larger blocks is faster */
 int pci_write_byte(struct pci_dev *, int pos, u8 data) PCI_ABI;
 int pci_write_word(struct pci_dev *, int pos, u16 data) PCI_ABI;
 int pci_write_long(struct pci_dev *, int pos, u32 data) PCI_ABI;
@@ -242,6 +249,17 @@ char *pci_get_string_property(struct pci_dev *d, u32 prop) PCI_ABI;
 
 void pci_setup_cache(struct pci_dev *, u8 *cache, int len) PCI_ABI;
 
+/*
+ * Read the first len bytes of configuration space of all devices on the
+ * list in a single pass. Back-ends which are able to do so read the data
+ * in bulk, the others fall back to pci_read_block(). Subsequent reads
+ * which fall into the prefetched range (which can be shorter than len if
+ * the device or the back-end does not allow access to all of it) are
+ * served from memory. Writes drop the prefetched data from the written
+ * position on, since they can have side effects on other registers.
+ */
+void pci_prefetch_config(struct pci_access *, int len) PCI_ABI;
+
 /*
  *	Capabilities
  */
@@ -251,6 +269,8 @@ struct pci_cap {
   u16 id;				/* PCI_CAP_ID_xxx */
   u16 type;				/* PCI_CAP_xxx */
   unsigned int addr;			/* Position in the config space */
+  unsigned int len;			/* Extent of the capability (up to the next one, limited for the last one) */
+  u8 *data;				/* Contents of the capability, read by pci_get_cap_table() */
 };
 
 #define PCI_CAP_NORMAL		1	/* Traditional PCI capabilities */
@@ -260,6 +280,15 @@ struct pci_cap *pci_find_cap(struct pci_dev *, unsigned int id, unsigned int typ
 struct pci_cap *pci_find_cap_nr(struct pci_dev *, unsigned int id, unsigned int type,
                                 unsigned int *cap_number) PCI_ABI;
 
+/*
+ * Scan capabilities of the types selected by flags (PCI_FILL_CAPS and/or
+ * PCI_FILL_EXT_CAPS) and read the contents of each of them in a single
+ * block. Returns the list of all known capabilities. The data of each
+ * capability (cap->len bytes starting at cap->addr) are kept in cap->data,
+ * which stays NULL if they could not be read.
+ */
+struct pci_cap *pci_get_cap_table(struct pci_dev *, unsigned int flags) PCI_ABI;
+
 /*
  *	Filters
  */
@@ -278,6 +307,18 @@ char *pci_filter_parse_slot(struct pci_filter *, char *) PCI_ABI;
 char *pci_filter_parse_id(struct pci_filter *, char *) PCI_ABI;
 int pci_filter_match(struct pci_filter *, struct pci_dev *) PCI_ABI;
 
+/*
+ * When matching devices against many filters, it is faster to compile
+ * them to a filter set first. pci_filter_set_match() stores indices of all
+ * filters matching the given device to the result array (which must have
+ * room for all filters) in increasing order and returns their number.
+ */
+struct pci_filter_set;
+
+struct pci_filter_set *pci_filter_set_compile(struct pci_access *, struct pci_filter **filters, int count) PCI_ABI;
+int pci_filter_set_match(struct pci_filter_set *, struct pci_dev *, int *result) PCI_ABI;
+void pci_filter_set_free(struct pci_filter_set *) PCI_ABI;
+
 /*
  *	Conversion of PCI ID's to names (according to the pci.ids file)
  *
@@ -298,6 +339,8 @@ char *pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
 
 int pci_load_name_list(struct pci_access *a) PCI_ABI;	/* Called automatically by pci_lookup_*() when needed; returns success */
 void pci_free_name_list(struct pci_access *a) PCI_ABI;	/* Called automatically by pci_cleanup() */
+void pci_prefetch_names(struct pci_access *a, struct pci_filter *f, int what) PCI_ABI;	/* Resolve names of matching devices via DNS in parallel, what=PCI_LOOKUP_xxx kinds of names */
+int pci_write_name_index(struct pci_access *a) PCI_ABI;	/* Write a binary index next to the ID list; returns success */
 void pci_set_name_list_path(struct pci_access *a, char *name, int to_be_freed) PCI_ABI;
 void pci_id_cache_flush(struct pci_access *a) PCI_ABI;
 
@@ -0,0 +1,463 @@
+/*
+ *	The PCI Library -- Snapshot of the Device List
+ *
+ *	Copyright (c) 2026 The PCI Utilities contributors
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "internal.h"
+
+#ifdef PCI_HAVE_PM_LINUX_SYSFS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ *  A snapshot remembers the list of devices together with information
+ *  obtained by pci_fill_info(). Config space is never kept, reads always
+ *  go to the device. The back end which created the snapshot supplies
+ *  a signature of the current state of the system, a snapshot with
+ *  a different signature is ignored. When the library is closed, the
+ *  snapshot is generated again and written if it differs from the one
+ *  loaded, so that information obtained by the process (like additional
+ *  fields) is kept for the next time.
+ *
+ *  All numbers are in host byte order, the version and the size of the
+ *  device record double as a check of byte order and structure layout.
+ */
+
+#define SNAP_MAGIC "PCI-SNP\n"
+#define SNAP_VERSION 4
+
+/*
+ *  Fields which can be restored from the snapshot. The driver, IRQ, resources
+ *  and the state of RCD links can change without the signature noticing,
+ *  so they are always read again.
+ */
+#define SNAP_FIELDS (PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_PHYS_SLOT | PCI_FILL_MODULE_ALIAS | \
+		     PCI_FILL_LABEL | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP | \
+		     PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | PCI_FILL_PARENT)
+
+struct snap_header {
+  char magic[8];
+  u32 version;
+  u32 dev_size;				/* sizeof(struct snap_dev) */
+  u64 signature;
+  u32 count;				/* Number of devices */
+  u32 reserved;
+};
+
+struct snap_dev {
+  int domain;
+  u8 bus, dev, func;
+  u32 known_fields;
+  u16 vendor_id, device_id;
+  u16 device_class;
+  u16 subsys_vendor_id, subsys_id;
+  u8 prog_if, rev_id;
+  int numa_node;
+  int parent;				/* Index of the parent device or -1 */
+  int no_config_access;
+  int hdrtype;
+  u32 num_props;			/* Number of properties following the record */
+};
+
+struct snap_prop {
+  u32 key;
+  u32 len;				/* Including the trailing NUL, padded to a multiple of 8 */
+};
+
+#define SNAP_ALIGN(x) (((x) + 7) & ~7U)
+
+struct pci_snapshot {
+  char *path;
+  u64 signature;
+  byte *loaded;				/* Contents of a valid snapshot loaded, NULL if none */
+  size_t loaded_len;
+};
+
+struct snap_buf {
+  byte *data;
+  size_t len, size;
+};
+
+static void
+snap_init(struct pci_access *a, const char *path, u64 signature)
+{
+  struct pci_snapshot *s = pci_malloc(a, sizeof(*s));
+
+  s->path = pci_strdup(a, path);
+  s->signature = signature;
+  s->loaded = NULL;
+  s->loaded_len = 0;
+  a->snapshot = s;
+}
+
+static byte *
+snap_read_file(struct pci_access *a, const char *path, size_t *lenp)
+{
+  struct stat st;
+  byte *buf;
+  int fd, n;
+  size_t len;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct snap_header))
+    {
+      close(fd);
+      return NULL;
+    }
+  buf = pci_malloc(a, st.st_size);
+  for (len = 0; len < (size_t) st.st_size; len += n)
+    {
+      n = read(fd, buf + len, st.st_size - len);
+      if (n <= 0)
+	{
+	  close(fd);
+	  pci_mfree(buf);
+	  return NULL;
+	}
+    }
+  close(fd);
+  *lenp = len;
+  return buf;
+}
+
+/*
+ *  Try to create the device list from the snapshot stored at the given path.
+ *  Returns 1 if successful. In any case, the snapshot will be written there
+ *  by pci_snapshot_close() if needed.
+ */
+int
+pci_snapshot_load(struct pci_access *a, const char *path, u64 signature)
+{
+  struct snap_header *hdr;
+  struct snap_dev *sd;
+  struct snap_prop *sp;
+  struct pci_dev **devs, *d;
+  int *parents;
+  byte *buf, *pos, *end;
+  size_t len;
+  u32 i, j, n;
+
+  snap_init(a, path, signature);
+  buf = snap_read_file(a, path, &len);
+  if (!buf)
+    {
+      a->debug("Snapshot %s not available\n", path);
+      return 0;
+    }
+
+  hdr = (struct snap_header *) buf;
+  if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != SNAP_VERSION ||
+      hdr->dev_size != sizeof(struct snap_dev))
+    {
+      a->debug("Snapshot %s is invalid, ignoring\n", path);
+      pci_mfree(buf);
+      return 0;
+    }
+  if (hdr->signature != signature)
+    {
+      a->debug("Snapshot %s is stale, ignoring\n", path);
+      pci_mfree(buf);
+      return 0;
+    }
+
+  if (hdr->count > (len - sizeof(*hdr)) / sizeof(*sd))
+    {
+      a->debug("Snapshot %s is truncated, ignoring\n", path);
+      pci_mfree(buf);
+      return 0;
+    }
+  devs = pci_malloc(a, (hdr->count + 1) * sizeof(*devs));
+  parents = pci_malloc(a, (hdr->count + 1) * sizeof(*parents));
+  pos = (byte *) (hdr + 1);
+  end = buf + len;
+  for (n = 0; n < hdr->count; n++)
+    {
+      if ((size_t)(end - pos) < sizeof(*sd))
+	goto broken;
+      sd = (struct snap_dev *) pos;
+      pos += sizeof(*sd);
+
+      d = devs[n] = pci_alloc_dev(a);
+      d->domain = sd->domain;
+      d->bus = sd->bus;
+      d->dev = sd->dev;
+      d->func = sd->func;
+      d->known_fields = sd->known_fields & SNAP_FIELDS & ~PCI_FILL_PARENT;
+      d->vendor_id = sd->vendor_id;
+      d->device_id = sd->device_id;
+      d->device_class = sd->device_class;
+      d->subsys_vendor_id = sd->subsys_vendor_id;
+      d->subsys_id = sd->subsys_id;
+      d->prog_if = sd->prog_if;
+      d->rev_id = sd->rev_id;
+      d->numa_node = sd->numa_node;
+      d->no_config_access = sd->no_config_access;
+      d->hdrtype = sd->hdrtype;
+      parents[n] = (sd->known_fields & PCI_FILL_PARENT) ? sd->parent : -1;
+
+      for (j = 0; j < sd->num_props; j++)
+	{
+	  char *val;
+	  if ((size_t)(end - pos) < sizeof(*sp))
+	    goto broken;
+	  sp = (struct snap_prop *) pos;
+	  pos += sizeof(*sp);
+	  if (!sp->len || (sp->len & 7) || (size_t)(end - pos) < sp->len || pos[sp->len - 1] ||
+	      !(sp->key & SNAP_FIELDS))
+	    goto broken;
+	  val = pci_set_property(d, sp->key, (char *) pos);
+	  pos += sp->len;
+	  switch (sp->key)
+	    {
+	    case PCI_FILL_PHYS_SLOT:
+	      d->phy_slot = val;
+	      break;
+	    case PCI_FILL_MODULE_ALIAS:
+	      d->module_alias = val;
+	      break;
+	    case PCI_FILL_LABEL:
+	      d->label = val;
+	      break;
+	    }
+	}
+    }
+  if (pos != end)
+    goto broken;
+
+  for (i = 0; i < hdr->count; i++)
+    if (parents[i] >= 0 && (u32) parents[i] < hdr->count)
+      {
+	devs[i]->parent = devs[parents[i]];
+	devs[i]->known_fields |= PCI_FILL_PARENT;
+      }
+
+  /* Link in reverse order to get the same list as when the snapshot was taken */
+  for (i = hdr->count; i > 0; i--)
+    pci_link_dev(a, devs[i-1]);
+  a->debug("Loaded %u devices from snapshot %s\n", hdr->count, path);
+  a->snapshot->loaded = buf;
+  a->snapshot->loaded_len = len;
+  pci_mfree(parents);
+  pci_mfree(devs);
+  return 1;
+
+broken:
+  a->debug("Snapshot %s is truncated, ignoring\n", path);
+  for (i = 0; i < n; i++)
+    pci_free_dev(devs[i]);
+  pci_mfree(parents);
+  pci_mfree(devs);
+  pci_mfree(buf);
+  return 0;
+}
+
+/* Devices sorted by address, so that indices of parents can be found quickly */
+struct snap_ptr {
+  struct pci_dev *dev;
+  int index;
+};
+
+static int
+snap_ptr_cmp(const void *A, const void *B)
+{
+  const struct snap_ptr *a = A, *b = B;
+  return (a->dev < b->dev) ? -1 : (a->dev > b->dev);
+}
+
+static int
+snap_index(struct snap_ptr *ptrs, int count, struct pci_dev *d)
+{
+  struct snap_ptr key, *p;
+
+  key.dev = d;
+  p = bsearch(&key, ptrs, count, sizeof(*ptrs), snap_ptr_cmp);
+  return p ? p->index : -1;
+}
+
+static void
+snap_put(struct pci_access *a, struct snap_buf *b, const void *data, size_t len)
+{
+  if (b->len + len > b->size)
+    {
+      size_t size = b->size ? 2 * b->size : 4096;
+      byte *new;
+      while (size < b->len + len)
+	size *= 2;
+      new = pci_malloc(a, size);
+      memcpy(new, b->data, b->len);
+      pci_mfree(b->data);
+      b->data = new;
+      b->size = size;
+    }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void
+snap_build(struct pci_access *a, struct pci_snapshot *s, struct snap_buf *b)
+{
+  struct snap_header hdr;
+  struct snap_dev sd;
+  struct snap_prop sp;
+  struct pci_property *p;
+  struct pci_dev **devs, *d;
+  struct snap_ptr *ptrs;
+  static const byte zeroes[8];
+  int i, count;
+
+  count = 0;
+  for (d = a->devices; d; d = d->next)
+    count++;
+  devs = pci_malloc(a, (count + 1) * sizeof(*devs));
+  ptrs = pci_malloc(a, (count + 1) * sizeof(*ptrs));
+  count = 0;
+  for (d = a->devices; d; d = d->next)
+    {
+      ptrs[count].dev = d;
+      ptrs[count].index = count;
+      devs[count++] = d;
+    }
+  qsort(ptrs, count, sizeof(*ptrs), snap_ptr_cmp);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+  hdr.version = SNAP_VERSION;
+  hdr.dev_size = sizeof(struct snap_dev);
+  hdr.signature = s->signature;
+  hdr.count = count;
+  snap_put(a, b, &hdr, sizeof(hdr));
+
+  for (i = 0; i < count; i++)
+    {
+      d = devs[i];
+      memset(&sd, 0, sizeof(sd));
+      sd.domain = d->domain;
+      sd.bus = d->bus;
+      sd.dev = d->dev;
+      sd.func = d->func;
+      sd.known_fields = d->known_fields & SNAP_FIELDS;
+      sd.vendor_id = d->vendor_id;
+      sd.device_id = d->device_id;
+      sd.device_class = d->device_class;
+      sd.subsys_vendor_id = d->subsys_vendor_id;
+      sd.subsys_id = d->subsys_id;
+      sd.prog_if = d->prog_if;
+      sd.rev_id = d->rev_id;
+      sd.numa_node = d->numa_node;
+      sd.no_config_access = d->no_config_access;
+      sd.hdrtype = d->hdrtype;
+
+      sd.parent = -1;
+      if (d->known_fields & PCI_FILL_PARENT)
+	sd.parent = snap_index(ptrs, count, d->parent);
+      if (sd.parent < 0)
+	sd.known_fields &= ~PCI_FILL_PARENT;
+
+      for (p = d->properties; p; p = p->next)
+	if (p->key & SNAP_FIELDS)
+	  sd.num_props++;
+      snap_put(a, b, &sd, sizeof(sd));
+      for (p = d->properties; p; p = p->next)
+	{
+	  int l = strlen(p->value) + 1;
+	  if (!(p->key & SNAP_FIELDS))
+	    continue;
+	  sp.key = p->key;
+	  sp.len = SNAP_ALIGN(l);
+	  snap_put(a, b, &sp, sizeof(sp));
+	  snap_put(a, b, p->value, l);
+	  snap_put(a, b, zeroes, sp.len - l);
+	}
+    }
+
+  pci_mfree(ptrs);
+  pci_mfree(devs);
+}
+
+static void
+snap_write(struct pci_access *a, struct pci_snapshot *s, struct snap_buf *b)
+{
+  char *tmpname = pci_malloc(a, strlen(s->path) + 32);
+  size_t pos;
+  int fd, n;
+
+  sprintf(tmpname, "%s.tmp-%d", s->path, (int) getpid());
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    {
+      a->debug("Cannot write snapshot %s: %s\n", s->path, strerror(errno));
+      pci_mfree(tmpname);
+      return;
+    }
+  a->debug("Writing snapshot %s\n", s->path);
+
+  for (pos = 0; pos < b->len; pos += n)
+    {
+      n = write(fd, b->data + pos, b->len - pos);
+      if (n <= 0)
+	{
+	  a->warning("Error writing %s: %s", tmpname, strerror(errno));
+	  close(fd);
+	  unlink(tmpname);
+	  pci_mfree(tmpname);
+	  return;
+	}
+    }
+  close(fd);
+
+  if (rename(tmpname, s->path) < 0)
+    {
+      a->warning("Cannot rename %s to %s: %s", tmpname, s->path, strerror(errno));
+      unlink(tmpname);
+    }
+  pci_mfree(tmpname);
+}
+
+/* Called before the devices are freed */
+void
+pci_snapshot_close(struct pci_access *a)
+{
+  struct pci_snapshot *s = a->snapshot;
+  struct snap_buf b;
+
+  if (!s)
+    return;
+
+  memset(&b, 0, sizeof(b));
+  snap_build(a, s, &b);
+  if (!s->loaded || s->loaded_len != b.len || memcmp(s->loaded, b.data, b.len))
+    snap_write(a, s, &b);
+
+  pci_mfree(b.data);
+  pci_mfree(s->loaded);
+  pci_mfree(s->path);
+  pci_mfree(s);
+  a->snapshot = NULL;
+}
+
+#else
+
+int pci_snapshot_load(struct pci_access *a UNUSED, const char *path UNUSED, u64 signature UNUSED)
+{
+  return 0;
+}
+
+void pci_snapshot_close(struct pci_access *a UNUSED)
+{
+}
+
+#endif
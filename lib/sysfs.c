@@ -21,13 +21,54 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "internal.h"
 
+#ifndef O_PATH
+#define O_PATH 0
+#endif
+
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+ *  Open config and VPD files are kept per device. To avoid running out of
+ *  file descriptors on large machines, only a bounded number of devices
+ *  may have their files open at a time, the least recently used ones are
+ *  closed first.
+ */
+
+struct sysfs_dev {
+  struct pci_dev *dev;
+  struct sysfs_dev *lru_prev, *lru_next;	/* LRU list of devices with open files */
+  int fd;				/* Config space, -1 if not open */
+  int fd_rw;				/* Config space opened read-write */
+  int fd_vpd;				/* VPD, -1 if not open */
+  int fd_dir;				/* Device directory, -1 if not open */
+  int in_lru;				/* Linked in the LRU list */
+  int vpd_bytes;			/* Statistics of VPD reads for debugging */
+  long vpd_usec;
+};
+
+// Back-end data linked to struct pci_access
+struct sysfs_access {
+  struct sysfs_dev *lru_first, *lru_last;
+  int open_devs;
+  int max_open_devs;
+};
+
 static void
 sysfs_config(struct pci_access *a)
 {
   pci_define_param(a, "sysfs.path", PCI_PATH_SYS_BUS_PCI, "Path to the sysfs device tree");
+  pci_define_param(a, "sysfs.fd_cache", "64", "Maximum number of devices with open sysfs files");
+  pci_define_param(a, "sysfs.snapshot", "", "File with a snapshot of the device list (empty=disabled)");
+#ifdef PCI_HAVE_PTHREADS
+  pci_define_param(a, "sysfs.threads", "0", "Number of threads reading device attributes during the scan (0=disabled)");
+#endif
 }
 
 static inline char *
@@ -51,30 +92,122 @@ sysfs_detect(struct pci_access *a)
 static void
 sysfs_init(struct pci_access *a)
 {
-  a->fd = -1;
-  a->fd_vpd = -1;
+  struct sysfs_access *sacc = pci_malloc(a, sizeof(*sacc));
+
+  memset(sacc, 0, sizeof(*sacc));
+  sacc->max_open_devs = atoi(pci_get_param(a, "sysfs.fd_cache"));
+  if (sacc->max_open_devs < 1)
+    sacc->max_open_devs = 1;
+  a->backend_data = sacc;
 }
 
 static void
-sysfs_flush_cache(struct pci_access *a)
+sysfs_lru_unlink(struct sysfs_access *sacc, struct sysfs_dev *sd)
 {
-  if (a->fd >= 0)
+  if (sd->lru_prev)
+    sd->lru_prev->lru_next = sd->lru_next;
+  else
+    sacc->lru_first = sd->lru_next;
+  if (sd->lru_next)
+    sd->lru_next->lru_prev = sd->lru_prev;
+  else
+    sacc->lru_last = sd->lru_prev;
+  sd->lru_prev = sd->lru_next = NULL;
+}
+
+static void
+sysfs_lru_link(struct sysfs_access *sacc, struct sysfs_dev *sd)
+{
+  sd->lru_prev = NULL;
+  sd->lru_next = sacc->lru_first;
+  if (sacc->lru_first)
+    sacc->lru_first->lru_prev = sd;
+  else
+    sacc->lru_last = sd;
+  sacc->lru_first = sd;
+}
+
+static void
+sysfs_close_dev(struct sysfs_access *sacc, struct sysfs_dev *sd)
+{
+  if (!sd->in_lru)
+    return;
+  if (sd->fd >= 0)
+    {
+      close(sd->fd);
+      sd->fd = -1;
+    }
+  if (sd->fd_vpd >= 0)
+    {
+      close(sd->fd_vpd);
+      sd->fd_vpd = -1;
+    }
+  if (sd->fd_dir >= 0)
+    {
+      close(sd->fd_dir);
+      sd->fd_dir = -1;
+    }
+  sysfs_lru_unlink(sacc, sd);
+  sd->in_lru = 0;
+  sacc->open_devs--;
+}
+
+static struct sysfs_dev *
+sysfs_get_dev(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = d->backend_data;
+
+  if (!sd)
     {
-      close(a->fd);
-      a->fd = -1;
+      sd = pci_malloc(d->access, sizeof(*sd));
+      memset(sd, 0, sizeof(*sd));
+      sd->dev = d;
+      sd->fd = -1;
+      sd->fd_vpd = -1;
+      sd->fd_dir = -1;
+      d->backend_data = sd;
     }
-  if (a->fd_vpd >= 0)
+  return sd;
+}
+
+/* Mark the device as the most recently used one, closing the files of the least recently used devices if needed */
+static void
+sysfs_touch_dev(struct pci_access *a, struct sysfs_dev *sd)
+{
+  struct sysfs_access *sacc = a->backend_data;
+
+  if (sd->in_lru)
     {
-      close(a->fd_vpd);
-      a->fd_vpd = -1;
+      if (sacc->lru_first != sd)
+	{
+	  sysfs_lru_unlink(sacc, sd);
+	  sysfs_lru_link(sacc, sd);
+	}
+      return;
     }
-  a->cached_dev = NULL;
+
+  while (sacc->open_devs >= sacc->max_open_devs)
+    sysfs_close_dev(sacc, sacc->lru_last);
+  sysfs_lru_link(sacc, sd);
+  sd->in_lru = 1;
+  sacc->open_devs++;
+}
+
+static void
+sysfs_flush_cache(struct pci_access *a)
+{
+  struct sysfs_access *sacc = a->backend_data;
+
+  while (sacc->lru_first)
+    sysfs_close_dev(sacc, sacc->lru_first);
 }
 
 static void
 sysfs_cleanup(struct pci_access *a)
 {
   sysfs_flush_cache(a);
+  pci_mfree(a->backend_data);
+  a->backend_data = NULL;
 }
 
 #define OBJNAMELEN 1024
@@ -87,50 +220,100 @@ sysfs_obj_name(struct pci_dev *d, char *object, char *buf)
     d->access->error("File name too long");
 }
 
+/*
+ *  Attributes are opened relative to the directory of the device, which
+ *  saves the kernel from walking the whole path for every attribute.
+ */
+static int
+sysfs_open_dir(struct pci_dev *d)
+{
+  char namebuf[OBJNAMELEN];
+
+  sysfs_obj_name(d, "", namebuf);
+  return open(namebuf, O_RDONLY | O_DIRECTORY | O_PATH);
+}
+
+/* Get the directory fd cached with the device; must not be called from worker threads */
+static int
+sysfs_get_dir(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = sysfs_get_dev(d);
+
+  sysfs_touch_dev(d->access, sd);
+  if (sd->fd_dir < 0)
+    sd->fd_dir = sysfs_open_dir(d);
+  return sd->fd_dir;
+}
+
 #define OBJBUFSIZE 1024
 
+/* Read an attribute, return its length or -1 on error */
 static int
-sysfs_get_string(struct pci_dev *d, char *object, char *buf, int mandatory)
+sysfs_read_attr(struct pci_dev *d, int dirfd, char *object, char *buf, int bufsize, int mandatory)
 {
   struct pci_access *a = d->access;
-  int fd, n;
+  int fd, n, read_errno;
   char namebuf[OBJNAMELEN];
   void (*warn)(char *msg, ...) = (mandatory ? a->error : a->warning);
 
-  sysfs_obj_name(d, object, namebuf);
-  fd = open(namebuf, O_RDONLY);
+  if (dirfd >= 0)
+    fd = openat(dirfd, object, O_RDONLY);
+  else
+    {
+      /* Fall back to the full path to get a meaningful error */
+      sysfs_obj_name(d, object, namebuf);
+      fd = open(namebuf, O_RDONLY);
+    }
   if (fd < 0)
     {
       if (mandatory || errno != ENOENT)
-	warn("Cannot open %s: %s", namebuf, strerror(errno));
-      return 0;
+	{
+	  int open_errno = errno;
+	  sysfs_obj_name(d, object, namebuf);
+	  warn("Cannot open %s: %s", namebuf, strerror(open_errno));
+	}
+      return -1;
     }
-  n = read(fd, buf, OBJBUFSIZE);
-  int read_errno = errno;
+  n = read(fd, buf, bufsize);
+  read_errno = errno;
   close(fd);
   if (n < 0)
     {
+      sysfs_obj_name(d, object, namebuf);
       warn("Error reading %s: %s", namebuf, strerror(read_errno));
-      return 0;
+      return -1;
     }
-  if (n >= OBJBUFSIZE)
+  if (n >= bufsize)
     {
+      sysfs_obj_name(d, object, namebuf);
       warn("Value in %s too long", namebuf);
-      return 0;
+      return -1;
     }
   buf[n] = 0;
-  return 1;
+  return n;
+}
+
+static int
+sysfs_get_string(struct pci_dev *d, int dirfd, char *object, char *buf, int mandatory)
+{
+  return sysfs_read_attr(d, dirfd, object, buf, OBJBUFSIZE, mandatory) >= 0;
 }
 
 static char *
-sysfs_deref_link(struct pci_dev *d, char *link_name)
+sysfs_deref_link(struct pci_dev *d, int dirfd, char *link_name)
 {
   char path[2*OBJNAMELEN], rel_path[OBJNAMELEN];
+  int n;
 
-  sysfs_obj_name(d, link_name, path);
   memset(rel_path, 0, sizeof(rel_path));
-
-  if (readlink(path, rel_path, sizeof(rel_path)) < 0)
+  if (dirfd >= 0)
+    n = readlinkat(dirfd, link_name, rel_path, sizeof(rel_path));
+  else
+    {
+      sysfs_obj_name(d, link_name, path);
+      n = readlink(path, rel_path, sizeof(rel_path));
+    }
+  if (n < 0)
     return NULL;
 
   sysfs_obj_name(d, "", path);
@@ -141,38 +324,59 @@ sysfs_deref_link(struct pci_dev *d, char *link_name)
 }
 
 static int
-sysfs_get_value(struct pci_dev *d, char *object, int mandatory)
+sysfs_get_value(struct pci_dev *d, int dirfd, char *object, int mandatory)
 {
   char buf[OBJBUFSIZE];
 
-  if (sysfs_get_string(d, object, buf, mandatory))
+  if (sysfs_get_string(d, dirfd, object, buf, mandatory))
     return strtol(buf, NULL, 0);
   else
     return -1;
 }
 
+struct sysfs_attr {
+  char *name;				/* Name of the attribute file */
+  int mandatory;
+  int wanted;				/* Skip the attribute if zero */
+  int value;				/* Numeric value, -1 if not available */
+};
+
+/* Read a batch of numeric attributes */
 static void
-sysfs_get_resources(struct pci_dev *d)
+sysfs_get_values(struct pci_dev *d, int dirfd, struct sysfs_attr *attrs, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    attrs[i].value = attrs[i].wanted ? sysfs_get_value(d, dirfd, attrs[i].name, attrs[i].mandatory) : -1;
+}
+
+static void
+sysfs_get_resources(struct pci_dev *d, int dirfd)
 {
   struct pci_access *a = d->access;
-  char namebuf[OBJNAMELEN], buf[256];
+  char namebuf[OBJNAMELEN], buf[4096];
+  char *line, *next;
   struct { pciaddr_t flags, base_addr, size; } lines[10];
   int have_bar_bases, have_rom_base, have_bridge_bases;
-  FILE *file;
   int i;
 
   have_bar_bases = have_rom_base = have_bridge_bases = 0;
-  sysfs_obj_name(d, "resource", namebuf);
-  file = fopen(namebuf, "r");
-  if (!file)
-    a->error("Cannot open %s: %s", namebuf, strerror(errno));
+  sysfs_read_attr(d, dirfd, "resource", buf, sizeof(buf), 1);
+  line = buf;
   for (i = 0; i < 7+6+4+1; i++)
     {
       unsigned long long start, end, size, flags;
-      if (!fgets(buf, sizeof(buf), file))
+      if (!*line)
 	break;
-      if (sscanf(buf, "%llx %llx %llx", &start, &end, &flags) != 3)
-	a->error("Syntax error in %s", namebuf);
+      next = strchr(line, '\n');
+      next = next ? next+1 : line + strlen(line);
+      if (sscanf(line, "%llx %llx %llx", &start, &end, &flags) != 3)
+	{
+	  sysfs_obj_name(d, "resource", namebuf);
+	  a->error("Syntax error in %s", namebuf);
+	}
+      line = next;
       if (end > start)
 	size = end - start + 1;
       else
@@ -225,7 +429,6 @@ sysfs_get_resources(struct pci_dev *d)
         }
       have_bridge_bases = 1;
     }
-  fclose(file);
   if (!have_bar_bases)
     clear_fill(d, PCI_FILL_BASES | PCI_FILL_SIZES | PCI_FILL_IO_FLAGS);
   if (!have_rom_base)
@@ -234,19 +437,310 @@ sysfs_get_resources(struct pci_dev *d)
     clear_fill(d, PCI_FILL_BRIDGE_BASES);
 }
 
+/* Numeric attributes read in a single batch by sysfs_fill_attrs() */
+enum {
+  ATTR_VENDOR,
+  ATTR_DEVICE,
+  ATTR_CLASS,
+  ATTR_REVISION,
+  ATTR_SUBSYS_VENDOR,
+  ATTR_SUBSYS_DEVICE,
+  ATTR_IRQ,
+  ATTR_MAX
+};
+
+/*
+ *  Fill the fields which come from attributes of the device itself.
+ *  If config_ok is zero, we must not touch the config space (and the
+ *  shared state behind it), which allows calling this from worker threads.
+ */
+static void
+sysfs_fill_attrs(struct pci_dev *d, unsigned int flags, int config_ok)
+{
+  int dirfd = config_ok ? sysfs_get_dir(d) : sysfs_open_dir(d);
+  int value, want_class, want_class_ext;
+
+  if (!d->access->buscentric)
+    {
+      /*
+       *  These fields can be read from the config registers, but we want to show
+       *  the kernel's view, which has regions and IRQs remapped and other fields
+       *  (most importantly classes) possibly fixed if the device is known broken.
+       */
+      struct sysfs_attr attrs[ATTR_MAX] = {
+	[ATTR_VENDOR] =		{ "vendor", 1 },
+	[ATTR_DEVICE] =		{ "device", 1 },
+	[ATTR_CLASS] =		{ "class", 1 },
+	[ATTR_REVISION] =	{ "revision", 0 },
+	[ATTR_SUBSYS_VENDOR] =	{ "subsystem_vendor", 0 },
+	[ATTR_SUBSYS_DEVICE] =	{ "subsystem_device", 0 },
+	[ATTR_IRQ] =		{ "irq", 1 },
+      };
+
+      attrs[ATTR_VENDOR].wanted = attrs[ATTR_DEVICE].wanted = want_fill(d, flags, PCI_FILL_IDENT);
+      want_class = want_fill(d, flags, PCI_FILL_CLASS);
+      want_class_ext = want_fill(d, flags, PCI_FILL_CLASS_EXT);
+      attrs[ATTR_CLASS].wanted = want_class || want_class_ext;
+      attrs[ATTR_REVISION].wanted = want_class_ext;
+      attrs[ATTR_SUBSYS_VENDOR].wanted = attrs[ATTR_SUBSYS_DEVICE].wanted = want_fill(d, flags, PCI_FILL_SUBSYS);
+      attrs[ATTR_IRQ].wanted = want_fill(d, flags, PCI_FILL_IRQ);
+      sysfs_get_values(d, dirfd, attrs, ATTR_MAX);
+
+      if (attrs[ATTR_VENDOR].wanted)
+	{
+	  d->vendor_id = attrs[ATTR_VENDOR].value;
+	  d->device_id = attrs[ATTR_DEVICE].value;
+	}
+      if (want_class)
+	d->device_class = attrs[ATTR_CLASS].value >> 8;
+      if (want_class_ext)
+	{
+	  d->prog_if = attrs[ATTR_CLASS].value & 0xff;
+	  value = attrs[ATTR_REVISION].value;
+	  if (value < 0 && config_ok)
+	    value = pci_read_byte(d, PCI_REVISION_ID);
+	  if (value >= 0)
+	    d->rev_id = value;
+	  else if (!config_ok)
+	    clear_fill(d, PCI_FILL_CLASS_EXT);
+	}
+      if (attrs[ATTR_SUBSYS_VENDOR].wanted)
+	{
+	  if (attrs[ATTR_SUBSYS_VENDOR].value >= 0)
+	    {
+	      d->subsys_vendor_id = attrs[ATTR_SUBSYS_VENDOR].value;
+	      if (attrs[ATTR_SUBSYS_DEVICE].value >= 0)
+	        d->subsys_id = attrs[ATTR_SUBSYS_DEVICE].value;
+	    }
+	  else
+	    clear_fill(d, PCI_FILL_SUBSYS);
+	}
+      if (attrs[ATTR_IRQ].wanted)
+	d->irq = attrs[ATTR_IRQ].value;
+      if (want_fill(d, flags, PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES | PCI_FILL_IO_FLAGS | PCI_FILL_BRIDGE_BASES))
+	sysfs_get_resources(d, dirfd);
+    }
+
+  if (want_fill(d, flags, PCI_FILL_MODULE_ALIAS))
+    {
+      char buf[OBJBUFSIZE];
+      if (sysfs_get_string(d, dirfd, "modalias", buf, 0))
+	d->module_alias = pci_set_property(d, PCI_FILL_MODULE_ALIAS, buf);
+    }
+
+  if (want_fill(d, flags, PCI_FILL_LABEL))
+    {
+      char buf[OBJBUFSIZE];
+      if (sysfs_get_string(d, dirfd, "label", buf, 0))
+	d->label = pci_set_property(d, PCI_FILL_LABEL, buf);
+    }
+
+  if (want_fill(d, flags, PCI_FILL_NUMA_NODE))
+    d->numa_node = sysfs_get_value(d, dirfd, "numa_node", 0);
+
+  if (want_fill(d, flags, PCI_FILL_IOMMU_GROUP))
+    {
+      char *group_link = sysfs_deref_link(d, dirfd, "iommu_group");
+      if (group_link)
+        {
+          pci_set_property(d, PCI_FILL_IOMMU_GROUP, basename(group_link));
+          free(group_link);
+        }
+    }
+
+  if (want_fill(d, flags, PCI_FILL_DT_NODE))
+    {
+      char *node = sysfs_deref_link(d, dirfd, "of_node");
+      if (node)
+	{
+	  pci_set_property(d, PCI_FILL_DT_NODE, node);
+	  free(node);
+	}
+    }
+
+  if (want_fill(d, flags, PCI_FILL_DRIVER))
+    {
+      char *driver_path = sysfs_deref_link(d, dirfd, "driver");
+      if (driver_path)
+        {
+          char *driver = strrchr(driver_path, '/');
+          driver = driver ? driver+1 : driver_path;
+          pci_set_property(d, PCI_FILL_DRIVER, driver);
+          free(driver_path);
+        }
+      else
+        clear_fill(d, PCI_FILL_DRIVER);
+    }
+
+  if (want_fill(d, flags, PCI_FILL_RCD_LNK))
+    {
+      char buf[OBJBUFSIZE];
+      if (sysfs_get_string(d, dirfd, "rcd_link_cap", buf, 0))
+        d->rcd_link_cap = strtoul(buf, NULL, 16);
+      if (sysfs_get_string(d, dirfd, "rcd_link_ctrl", buf, 0))
+        d->rcd_link_ctrl = strtoul(buf, NULL, 16);
+      if (sysfs_get_string(d, dirfd, "rcd_link_status", buf, 0))
+        d->rcd_link_status = strtoul(buf, NULL, 16);
+    }
+
+  if (!config_ok && dirfd >= 0)
+    close(dirfd);
+}
+
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ *  Fields read by worker threads during the scan. We pick the ones
+ *  which are cheap to obtain from sysfs and which almost every user
+ *  of the library asks for.
+ */
+#define SYSFS_PARALLEL_FILL (PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | \
+			     PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES | \
+			     PCI_FILL_IO_FLAGS | PCI_FILL_BRIDGE_BASES | PCI_FILL_NUMA_NODE | \
+			     PCI_FILL_MODULE_ALIAS | PCI_FILL_LABEL)
+
+struct sysfs_fill_job {
+  struct pci_dev **devs;
+  int count;
+  int next;				/* Index of the next device to process */
+  pthread_mutex_t lock;
+};
+
+static void *
+sysfs_fill_worker(void *arg)
+{
+  struct sysfs_fill_job *job = arg;
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&job->lock);
+      i = job->next++;
+      pthread_mutex_unlock(&job->lock);
+      if (i >= job->count)
+	break;
+      sysfs_fill_attrs(job->devs[i], SYSFS_PARALLEL_FILL, 0);
+    }
+  return NULL;
+}
+
+static void
+sysfs_fill_parallel(struct pci_access *a, struct pci_dev **devs, int count, int threads)
+{
+  struct sysfs_fill_job job;
+  pthread_t *tids;
+  int i, started, err;
+
+  if (threads > count)
+    threads = count;
+  a->debug("sysfs: filling %d devices using %d threads\n", count, threads);
+
+  job.devs = devs;
+  job.count = count;
+  job.next = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* The calling thread is one of the workers */
+  tids = pci_malloc(a, threads * sizeof(pthread_t));
+  for (started = 0; started < threads - 1; started++)
+    if (err = pthread_create(&tids[started], NULL, sysfs_fill_worker, &job))
+      {
+	a->debug("sysfs: cannot create thread: %s\n", strerror(err));
+	break;
+      }
+  sysfs_fill_worker(&job);
+  for (i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+
+  pci_mfree(tids);
+  pthread_mutex_destroy(&job.lock);
+}
+
+#endif
+
+static u64
+sysfs_hash(u64 h, const void *data, size_t len)
+{
+  const byte *p = data;
+
+  while (len--)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  return h;
+}
+
+/*
+ *  The signature of the device list, used to validate snapshots. It covers
+ *  names and modification times of device directories and the modification
+ *  time of the list itself. It does not reliably change when a driver is bound
+ *  or when IRQs or resources are reassigned, so these are not kept in snapshots.
+ */
+static int
+sysfs_signature(struct pci_access *a, char *dirname, u64 *sig)
+{
+  u64 h = 0xcbf29ce484222325ULL;
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+  u64 t;
+
+  dir = opendir(dirname);
+  if (!dir)
+    return 0;
+  h = sysfs_hash(h, dirname, strlen(dirname));
+  if (!fstat(dirfd(dir), &st))
+    {
+      t = (u64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+      h = sysfs_hash(h, &t, sizeof(t));
+    }
+  while ((entry = readdir(dir)))
+    {
+      if (entry->d_name[0] == '.')
+	continue;
+      h = sysfs_hash(h, entry->d_name, strlen(entry->d_name) + 1);
+      if (!fstatat(dirfd(dir), entry->d_name, &st, 0))
+	{
+	  t = (u64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	  h = sysfs_hash(h, &t, sizeof(t));
+	  t = st.st_ino;
+	  h = sysfs_hash(h, &t, sizeof(t));
+	}
+    }
+  closedir(dir);
+  a->debug("sysfs: signature %016llx\n", (unsigned long long) h);
+  *sig = h;
+  return 1;
+}
+
 static void sysfs_scan(struct pci_access *a)
 {
   char dirname[1024];
   DIR *dir;
   struct dirent *entry;
-  int n;
+  struct pci_dev **devs;
+  int n, i, count, max_count;
+  char *snapshot = pci_get_param(a, "sysfs.snapshot");
+#ifdef PCI_HAVE_PTHREADS
+  int threads = atoi(pci_get_param(a, "sysfs.threads"));
+#endif
 
   n = snprintf(dirname, sizeof(dirname), "%s/devices", sysfs_name(a));
   if (n < 0 || n >= (int) sizeof(dirname))
     a->error("Directory name too long");
+
+  if (*snapshot && !a->buscentric)
+    {
+      u64 sig;
+      if (sysfs_signature(a, dirname, &sig) && pci_snapshot_load(a, snapshot, sig))
+	return;
+    }
+
   dir = opendir(dirname);
   if (!dir)
     a->error("Cannot open %s", dirname);
+
+  count = 0;
+  max_count = 64;
+  devs = pci_malloc(a, max_count * sizeof(*devs));
   while ((entry = readdir(dir)))
     {
       struct pci_dev *d;
@@ -268,9 +762,28 @@ static void sysfs_scan(struct pci_access *a)
       d->bus = bus;
       d->dev = dev;
       d->func = func;
-      pci_link_dev(a, d);
+
+      if (count == max_count)
+	{
+	  struct pci_dev **new_devs = pci_malloc(a, 2 * max_count * sizeof(*devs));
+	  memcpy(new_devs, devs, count * sizeof(*devs));
+	  pci_mfree(devs);
+	  devs = new_devs;
+	  max_count *= 2;
+	}
+      devs[count++] = d;
     }
   closedir(dir);
+
+#ifdef PCI_HAVE_PTHREADS
+  if (threads > 0 && count > 1 && !a->buscentric)
+    sysfs_fill_parallel(a, devs, count, threads);
+#endif
+
+  /* Link devices in readdir() order, so that the list does not depend on threading */
+  for (i = 0; i < count; i++)
+    pci_link_dev(a, devs[i]);
+  pci_mfree(devs);
 }
 
 static void
@@ -336,54 +849,10 @@ sysfs_fill_slots(struct pci_access *a)
 static void
 sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 {
-  int value, want_class, want_class_ext;
+  sysfs_fill_attrs(d, flags, 1);
 
   if (!d->access->buscentric)
     {
-      /*
-       *  These fields can be read from the config registers, but we want to show
-       *  the kernel's view, which has regions and IRQs remapped and other fields
-       *  (most importantly classes) possibly fixed if the device is known broken.
-       */
-      if (want_fill(d, flags, PCI_FILL_IDENT))
-	{
-	  d->vendor_id = sysfs_get_value(d, "vendor", 1);
-	  d->device_id = sysfs_get_value(d, "device", 1);
-	}
-      want_class = want_fill(d, flags, PCI_FILL_CLASS);
-      want_class_ext = want_fill(d, flags, PCI_FILL_CLASS_EXT);
-      if (want_class || want_class_ext)
-        {
-	  value = sysfs_get_value(d, "class", 1);
-	  if (want_class)
-	    d->device_class = value >> 8;
-	  if (want_class_ext)
-	    {
-	      d->prog_if = value & 0xff;
-	      value = sysfs_get_value(d, "revision", 0);
-	      if (value < 0)
-	        value = pci_read_byte(d, PCI_REVISION_ID);
-	      if (value >= 0)
-	        d->rev_id = value;
-	    }
-	}
-      if (want_fill(d, flags, PCI_FILL_SUBSYS))
-	{
-	  value = sysfs_get_value(d, "subsystem_vendor", 0);
-	  if (value >= 0)
-	    {
-	      d->subsys_vendor_id = value;
-	      value = sysfs_get_value(d, "subsystem_device", 0);
-	      if (value >= 0)
-	        d->subsys_id = value;
-	    }
-	  else
-	    clear_fill(d, PCI_FILL_SUBSYS);
-	}
-      if (want_fill(d, flags, PCI_FILL_IRQ))
-	  d->irq = sysfs_get_value(d, "irq", 1);
-      if (want_fill(d, flags, PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES | PCI_FILL_IO_FLAGS | PCI_FILL_BRIDGE_BASES))
-	  sysfs_get_resources(d);
       if (want_fill(d, flags, PCI_FILL_PARENT))
 	{
 	  unsigned int domain, bus, dev, func;
@@ -433,68 +902,6 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 	pd->known_fields |= PCI_FILL_PHYS_SLOT;
     }
 
-  if (want_fill(d, flags, PCI_FILL_MODULE_ALIAS))
-    {
-      char buf[OBJBUFSIZE];
-      if (sysfs_get_string(d, "modalias", buf, 0))
-	d->module_alias = pci_set_property(d, PCI_FILL_MODULE_ALIAS, buf);
-    }
-
-  if (want_fill(d, flags, PCI_FILL_LABEL))
-    {
-      char buf[OBJBUFSIZE];
-      if (sysfs_get_string(d, "label", buf, 0))
-	d->label = pci_set_property(d, PCI_FILL_LABEL, buf);
-    }
-
-  if (want_fill(d, flags, PCI_FILL_NUMA_NODE))
-    d->numa_node = sysfs_get_value(d, "numa_node", 0);
-
-  if (want_fill(d, flags, PCI_FILL_IOMMU_GROUP))
-    {
-      char *group_link = sysfs_deref_link(d, "iommu_group");
-      if (group_link)
-        {
-          pci_set_property(d, PCI_FILL_IOMMU_GROUP, basename(group_link));
-          free(group_link);
-        }
-    }
-
-  if (want_fill(d, flags, PCI_FILL_DT_NODE))
-    {
-      char *node = sysfs_deref_link(d, "of_node");
-      if (node)
-	{
-	  pci_set_property(d, PCI_FILL_DT_NODE, node);
-	  free(node);
-	}
-    }
-
-  if (want_fill(d, flags, PCI_FILL_DRIVER))
-    {
-      char *driver_path = sysfs_deref_link(d, "driver");
-      if (driver_path)
-        {
-          char *driver = strrchr(driver_path, '/');
-          driver = driver ? driver+1 : driver_path;
-          pci_set_property(d, PCI_FILL_DRIVER, driver);
-          free(driver_path);
-        }
-      else
-        clear_fill(d, PCI_FILL_DRIVER);
-    }
-
-  if (want_fill(d, flags, PCI_FILL_RCD_LNK))
-    {
-      char buf[OBJBUFSIZE];
-      if (sysfs_get_string(d, "rcd_link_cap", buf, 0))
-        d->rcd_link_cap = strtoul(buf, NULL, 16);
-      if (sysfs_get_string(d, "rcd_link_ctrl", buf, 0))
-        d->rcd_link_ctrl = strtoul(buf, NULL, 16);
-      if (sysfs_get_string(d, "rcd_link_status", buf, 0))
-        d->rcd_link_status = strtoul(buf, NULL, 16);
-    }
-
   pci_generic_fill_info(d, flags);
 }
 
@@ -510,34 +917,38 @@ static int
 sysfs_setup(struct pci_dev *d, int intent)
 {
   struct pci_access *a = d->access;
+  struct sysfs_dev *sd = sysfs_get_dev(d);
   char namebuf[OBJNAMELEN];
 
-  if (a->cached_dev != d || (intent == SETUP_WRITE_CONFIG && !a->fd_rw))
+  if (intent == SETUP_WRITE_CONFIG && sd->fd >= 0 && !sd->fd_rw)
     {
-      sysfs_flush_cache(a);
-      a->cached_dev = d;
+      close(sd->fd);
+      sd->fd = -1;
     }
 
+  sysfs_touch_dev(a, sd);
+
   if (intent == SETUP_READ_VPD)
     {
-      if (a->fd_vpd < 0)
+      if (sd->fd_vpd < 0)
 	{
-	  sysfs_obj_name(d, "vpd", namebuf);
-	  a->fd_vpd = open(namebuf, O_RDONLY);
+	  sd->fd_vpd = openat(sysfs_get_dir(d), "vpd", O_RDONLY);
 	  /* No warning on error; vpd may be absent or accessible only to root */
 	}
-      return a->fd_vpd;
+      return sd->fd_vpd;
     }
 
-  if (a->fd < 0)
+  if (sd->fd < 0)
     {
-      sysfs_obj_name(d, "config", namebuf);
-      a->fd_rw = a->writeable || intent == SETUP_WRITE_CONFIG;
-      a->fd = open(namebuf, a->fd_rw ? O_RDWR : O_RDONLY);
-      if (a->fd < 0)
-	a->warning("Cannot open %s", namebuf);
+      sd->fd_rw = a->writeable || intent == SETUP_WRITE_CONFIG;
+      sd->fd = openat(sysfs_get_dir(d), "config", sd->fd_rw ? O_RDWR : O_RDONLY);
+      if (sd->fd < 0)
+	{
+	  sysfs_obj_name(d, "config", namebuf);
+	  a->warning("Cannot open %s", namebuf);
+	}
     }
-  return a->fd;
+  return sd->fd;
 }
 
 static int sysfs_read(struct pci_dev *d, int pos, byte *buf, int len)
@@ -582,11 +993,26 @@ static int sysfs_write(struct pci_dev *d, int pos, byte *buf, int len)
 static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
 {
   int fd = sysfs_setup(d, SETUP_READ_VPD);
+  struct timeval start, stop;
   int res;
 
   if (fd < 0)
     return 0;
+  if (d->access->debugging)
+    gettimeofday(&start, NULL);
   res = pread(fd, buf, len, pos);
+  if (d->access->debugging)
+    {
+      struct sysfs_dev *sd = sysfs_get_dev(d);
+      long usec;
+      gettimeofday(&stop, NULL);
+      usec = (stop.tv_sec - start.tv_sec) * 1000000L + stop.tv_usec - start.tv_usec;
+      if (res > 0)
+	sd->vpd_bytes += res;
+      sd->vpd_usec += usec;
+      d->access->debug("sysfs: %04x:%02x:%02x.%d: read %d bytes of VPD at %x in %ld us (%d bytes, %ld us in total)\n",
+		       d->domain, d->bus, d->dev, d->func, res, pos, usec, sd->vpd_bytes, sd->vpd_usec);
+    }
   if (res < 0)
     {
       d->access->warning("sysfs_read_vpd: read failed: %s", strerror(errno));
@@ -597,12 +1023,39 @@ static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
   return 1;
 }
 
+/*
+ *  The config file is cut short by the kernel where the caller is not
+ *  allowed to read any further, so a single pread per device is enough.
+ */
+static void sysfs_prefetch(struct pci_access *a, int len)
+{
+  struct pci_dev *d;
+  int fd, res;
+
+  for (d = a->devices; d; d = d->next)
+    if (d->prefetch)
+      {
+	fd = sysfs_setup(d, SETUP_READ_CONFIG);
+	if (fd < 0)
+	  continue;
+	res = pread(fd, d->prefetch, len, 0);
+	if (res < 0)
+	  a->warning("sysfs_prefetch: read failed: %s", strerror(errno));
+	else
+	  d->prefetch_len = res;
+      }
+}
+
 static void sysfs_cleanup_dev(struct pci_dev *d)
 {
-  struct pci_access *a = d->access;
+  struct sysfs_dev *sd = d->backend_data;
 
-  if (a->cached_dev == d)
-    sysfs_flush_cache(a);
+  if (sd)
+    {
+      sysfs_close_dev(d->access->backend_data, sd);
+      pci_mfree(sd);
+      d->backend_data = NULL;
+    }
 }
 
 struct pci_methods pm_linux_sysfs = {
@@ -617,5 +1070,6 @@ struct pci_methods pm_linux_sysfs = {
   .read = sysfs_read,
   .write = sysfs_write,
   .read_vpd = sysfs_read_vpd,
+  .prefetch = sysfs_prefetch,
   .cleanup_dev = sysfs_cleanup_dev,
 };
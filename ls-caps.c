@@ -1798,6 +1798,9 @@ show_caps(struct device *d, int where)
   int can_have_ext_caps = 0;
   int type = -1;
 
+  if (where == PCI_CAPABILITY_LIST)
+    config_fetch_caps(d);
+
   if (get_conf_word(d, PCI_STATUS) & PCI_STATUS_CAP_LIST)
     {
       byte been_there[256];
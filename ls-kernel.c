@@ -9,13 +9,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "lspci.h"
 
 #ifdef PCI_OS_LINUX
 
 #include <sys/utsname.h>
+#include <fnmatch.h>
 
 #ifdef PCI_USE_LIBKMOD
 
@@ -52,62 +55,212 @@ failed:
   return 0;
 }
 
+/*
+ *  Functions of the same device (e.g., virtual functions) often share
+ *  the module alias, so we remember the result of each lookup for the
+ *  whole run instead of traversing the libkmod indices again.
+ */
+
+struct alias_entry {
+  struct alias_entry *next;
+  char **modules;			/* NULL-terminated list of module names */
+  char alias[1];
+};
+
+#define ALIAS_HASH_SIZE 1024
+
+static struct alias_entry *alias_hash[ALIAS_HASH_SIZE];
+
+static unsigned int
+alias_hash_of(const char *alias)
+{
+  unsigned int h = 0;
+
+  while (*alias)
+    h = h * 31 + (unsigned char) *alias++;
+  return h % ALIAS_HASH_SIZE;
+}
+
+static struct alias_entry *
+lookup_alias(const char *alias)
+{
+  unsigned int h = alias_hash_of(alias);
+  struct kmod_list *klist = NULL, *l;
+  struct alias_entry *e;
+  int err, n;
+
+  for (e = alias_hash[h]; e; e = e->next)
+    if (!strcmp(e->alias, alias))
+      return e;
+
+  err = kmod_module_new_from_lookup(kmod_ctx, alias, &klist);
+  if (err < 0)
+    {
+      fprintf(stderr, "lspci: libkmod lookup failed: error %d\n", err);
+      return NULL;
+    }
+
+  e = xmalloc(sizeof(*e) + strlen(alias));
+  strcpy(e->alias, alias);
+  n = 0;
+  kmod_list_foreach(l, klist)
+    n++;
+  e->modules = xmalloc((n + 1) * sizeof(char *));
+  n = 0;
+  kmod_list_foreach(l, klist)
+    {
+      struct kmod_module *kmodule = kmod_module_get_module(l);
+      e->modules[n++] = xstrdup(kmod_module_get_name(kmodule));
+      kmod_module_unref(kmodule);
+    }
+  e->modules[n] = NULL;
+  kmod_module_unref_list(klist);
+
+  e->next = alias_hash[h];
+  alias_hash[h] = e;
+  return e;
+}
+
 void
 show_kernel_cleanup(void)
 {
+  struct alias_entry *e;
+  int h, i;
+
+  for (h=0; h < ALIAS_HASH_SIZE; h++)
+    while (e = alias_hash[h])
+      {
+	alias_hash[h] = e->next;
+	for (i=0; e->modules[i]; i++)
+	  free(e->modules[i]);
+	free(e->modules);
+	free(e);
+      }
   if (kmod_ctx)
     kmod_unref(kmod_ctx);
 }
 
 static const char *next_module(struct device *d)
 {
-  static struct kmod_list *klist, *kcurrent;
-  static struct kmod_module *kmodule;
+  static struct alias_entry *current;
+  static int pos;
 
-  if (kmodule)
-    {
-      kmod_module_unref(kmodule);
-      kmodule = NULL;
-    }
-
-  if (!klist)
+  if (!current)
     {
       pci_fill_info(d->dev, PCI_FILL_MODULE_ALIAS);
       if (!d->dev->module_alias)
 	return NULL;
-      int err = kmod_module_new_from_lookup(kmod_ctx, d->dev->module_alias, &klist);
-      if (err < 0)
-	{
-	  fprintf(stderr, "lspci: libkmod lookup failed: error %d\n", err);
-	  return NULL;
-	}
-      kcurrent = klist;
+      current = lookup_alias(d->dev->module_alias);
+      if (!current)
+	return NULL;
+      pos = 0;
     }
-  else
-    kcurrent = kmod_list_next(klist, kcurrent);
 
-  if (kcurrent)
-    {
-      kmodule = kmod_module_get_module(kcurrent);
-      return kmod_module_get_name(kmodule);
-    }
+  if (current->modules[pos])
+    return current->modules[pos++];
 
-  kmod_module_unref_list(klist);
-  klist = NULL;
+  current = NULL;
   return NULL;
 }
 
 #else
 
+/*
+ *  Entries of modules.pcimap and the "pci:" entries of modules.alias are
+ *  hashed by the vendor ID, entries matching any vendor are kept in an
+ *  extra bucket. Each bucket is ordered by decreasing sequence number,
+ *  so we can merge the two buckets relevant to a device and obtain the
+ *  matches in the same order as a single list would give.
+ */
+
 struct pcimap_entry {
   struct pcimap_entry *next;
+  unsigned int seq;
   unsigned int vendor, device;
   unsigned int subvendor, subdevice;
   unsigned int class, class_mask;
+  char *alias;				/* Pattern from modules.alias, NULL for pcimap entries */
   char module[1];
 };
 
-static struct pcimap_entry *pcimap_head;
+#define PCIMAP_HASH_SIZE 1024
+#define PCIMAP_ANY PCIMAP_HASH_SIZE	/* Bucket for entries matching any vendor */
+
+static struct pcimap_entry *pcimap_hash[PCIMAP_HASH_SIZE + 1];
+static unsigned int pcimap_seq;
+
+static void
+pcimap_add(struct pcimap_entry *e)
+{
+  unsigned int h = (e->vendor > 0xffff) ? PCIMAP_ANY : e->vendor % PCIMAP_HASH_SIZE;
+
+  e->seq = pcimap_seq++;
+  e->next = pcimap_hash[h];
+  pcimap_hash[h] = e;
+}
+
+/* Parse "alias pci:v0000VVVVd... module", remembering the vendor ID unless it is a pattern */
+static struct pcimap_entry *
+parse_alias(char *line)
+{
+  struct pcimap_entry *e;
+  char *pattern, *module, *c;
+  unsigned int vendor = ~0U;
+  int i;
+
+  if (strncmp(line, "alias pci:", 10))
+    return NULL;
+  pattern = line + 6;
+  module = strchr(pattern, ' ');
+  if (!module)
+    return NULL;
+  *module++ = 0;
+
+  c = pattern + 5;
+  for (i=0; i<8 && isxdigit(c[i]); i++)
+    ;
+  if (i == 8 && c[8] == 'd')
+    {
+      char hex[9];
+      memcpy(hex, c, 8);
+      hex[8] = 0;
+      vendor = strtoul(hex, NULL, 16);
+    }
+
+  e = xmalloc(sizeof(*e) + strlen(module) + strlen(pattern) + 1);
+  memset(e, 0, sizeof(*e));
+  e->vendor = vendor;
+  strcpy(e->module, module);
+  e->alias = e->module + strlen(module) + 1;
+  strcpy(e->alias, pattern);
+  return e;
+}
+
+static struct pcimap_entry *
+parse_pcimap(char *line)
+{
+  struct pcimap_entry *e;
+  char *c = line;
+
+  while (*c && *c != ' ' && *c != '\t')
+    c++;
+  if (!*c)
+    return NULL;	/* FIXME: Emit warnings! */
+  *c++ = 0;
+
+  e = xmalloc(sizeof(*e) + strlen(line));
+  if (sscanf(c, "%i%i%i%i%i%i",
+	     &e->vendor, &e->device,
+	     &e->subvendor, &e->subdevice,
+	     &e->class, &e->class_mask) != 6)
+    {
+      free(e);
+      return NULL;
+    }
+  e->alias = NULL;
+  strcpy(e->module, line);
+  return e;
+}
 
 static int
 show_kernel_init(void)
@@ -135,7 +288,13 @@ show_kernel_init(void)
       sprintf(name, "/lib/modules/%s/modules.pcimap", uts.release);
       f = fopen(name, "r");
       if (!f)
-	return 1;
+	{
+	  /* Module tools have stopped generating modules.pcimap long ago */
+	  sprintf(name, "/lib/modules/%s/modules.alias", uts.release);
+	  f = fopen(name, "r");
+	  if (!f)
+	    return 1;
+	}
     }
 
   while (fgets(line, sizeof(line), f))
@@ -149,22 +308,12 @@ show_kernel_init(void)
       if (!line[0] || line[0] == '#')
 	continue;
 
-      c = line;
-      while (*c && *c != ' ' && *c != '\t')
-	c++;
-      if (!*c)
-	continue;	/* FIXME: Emit warnings! */
-      *c++ = 0;
-
-      e = xmalloc(sizeof(*e) + strlen(line));
-      if (sscanf(c, "%i%i%i%i%i%i",
-		 &e->vendor, &e->device,
-		 &e->subvendor, &e->subdevice,
-		 &e->class, &e->class_mask) != 6)
-	continue;
-      e->next = pcimap_head;
-      pcimap_head = e;
-      strcpy(e->module, line);
+      if (!strncmp(line, "alias ", 6))
+	e = parse_alias(line);
+      else
+	e = parse_pcimap(line);
+      if (e)
+	pcimap_add(e);
     }
   fclose(f);
 
@@ -177,6 +326,12 @@ match_pcimap(struct device *d, struct pcimap_entry *e)
   struct pci_dev *dev = d->dev;
   unsigned int class = (((unsigned int)dev->device_class << 8) | dev->prog_if);
 
+  if (e->alias)
+    {
+      pci_fill_info(dev, PCI_FILL_MODULE_ALIAS);
+      return dev->module_alias && !fnmatch(e->alias, dev->module_alias, 0);
+    }
+
 #define MATCH(x, y) ((y) > 0xffff || (x) == (y))
   return
     MATCH(dev->vendor_id, e->vendor) &&
@@ -187,23 +342,43 @@ match_pcimap(struct device *d, struct pcimap_entry *e)
 #undef MATCH
 }
 
-static const char *next_module(struct device *d)
+static struct pcimap_entry *
+next_match(struct device *d, struct pcimap_entry *e)
 {
-  static struct pcimap_entry *current;
+  while (e && !match_pcimap(d, e))
+    e = e->next;
+  return e;
+}
 
-  if (!current)
-    current = pcimap_head;
-  else
-    current = current->next;
+static const char *next_module(struct device *d)
+{
+  static struct pcimap_entry *cur_vendor, *cur_any;
+  static int started;
+  struct pcimap_entry *e;
 
-  while (current)
+  if (!started)
     {
-      if (match_pcimap(d, current))
-	return current->module;
-      current = current->next;
+      cur_vendor = next_match(d, pcimap_hash[d->dev->vendor_id % PCIMAP_HASH_SIZE]);
+      cur_any = next_match(d, pcimap_hash[PCIMAP_ANY]);
+      started = 1;
     }
 
-  return NULL;
+  if (cur_vendor && (!cur_any || cur_vendor->seq > cur_any->seq))
+    {
+      e = cur_vendor;
+      cur_vendor = next_match(d, e->next);
+    }
+  else if (cur_any)
+    {
+      e = cur_any;
+      cur_any = next_match(d, e->next);
+    }
+  else
+    {
+      started = 0;
+      return NULL;
+    }
+  return e->module;
 }
 
 void
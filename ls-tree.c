@@ -14,42 +14,125 @@
 
 #include "lspci.h"
 
-struct bridge host_bridge = { NULL, NULL, NULL, NULL, NULL, NULL, ~0, ~0, ~0, ~0, NULL };
+struct bridge host_bridge = { NULL, NULL, NULL, NULL, NULL, NULL, ~0, ~0, ~0, ~0, NULL, NULL };
+
+/*
+ *  With thousands of devices (e.g., SR-IOV virtual functions), walking
+ *  lists for every device would make building of the tree quadratic,
+ *  so we keep all buses in a hash table indexed by (domain, bus) and
+ *  devices in a hash table indexed by their struct pci_dev.
+ */
+
+#define BUS_HASH_SIZE 1024
+
+static struct bus *bus_hash[BUS_HASH_SIZE];
+
+static struct device **dev_hash;
+static unsigned int dev_hash_size;
+
+static inline unsigned int
+bus_hash_of(unsigned int domain, unsigned int n)
+{
+  return (domain * 256 + n) % BUS_HASH_SIZE;
+}
 
 static struct bus *
 find_bus(struct bridge *b, unsigned int domain, unsigned int n)
 {
   struct bus *bus;
 
-  for (bus=b->first_bus; bus; bus=bus->sibling)
-    if (bus->domain == domain && bus->number == n)
+  for (bus=bus_hash[bus_hash_of(domain, n)]; bus; bus=bus->hash_next)
+    if (bus->parent_bridge == b && bus->domain == domain && bus->number == n)
       break;
   return bus;
 }
 
+static inline unsigned int
+dev_hash_of(struct pci_dev *dd)
+{
+  return ((unsigned long) dd / sizeof(void *) * 0x9e3779b1) & (dev_hash_size - 1);
+}
+
+static void
+hash_devices(void)
+{
+  struct device *d;
+  unsigned int cnt = 0, h;
+
+  for (d=first_dev; d; d=d->next)
+    cnt++;
+  dev_hash_size = 16;
+  while (dev_hash_size < 2*cnt)
+    dev_hash_size *= 2;
+  dev_hash = xmalloc(dev_hash_size * sizeof(struct device *));
+  memset(dev_hash, 0, dev_hash_size * sizeof(struct device *));
+
+  for (d=first_dev; d; d=d->next)
+    {
+      for (h = dev_hash_of(d->dev); dev_hash[h]; h = (h+1) & (dev_hash_size - 1))
+	;
+      dev_hash[h] = d;
+    }
+}
+
 static struct device *
 find_device(struct pci_dev *dd)
 {
   struct device *d;
+  unsigned int h;
 
   if (!dd)
     return NULL;
-  for (d=first_dev; d; d=d->next)
+  for (h = dev_hash_of(dd); d = dev_hash[h]; h = (h+1) & (dev_hash_size - 1))
     if (d->dev == dd)
       break;
   return d;
 }
 
+/* Find the first child (in the order of the child list) whose bus range contains the given bus */
+static struct bridge *
+find_child(struct bridge *b, unsigned int domain, unsigned int n)
+{
+  struct bridge *c;
+  unsigned int i, last;
+
+  if (b == &host_bridge || domain != b->domain || n > 255)
+    {
+      for (c=b->child; c; c=c->prev)
+	if (c->domain == domain && c->secondary <= n && n <= c->subordinate)
+	  return c;
+      return NULL;
+    }
+
+  if (!b->child_index)
+    {
+      b->child_index = xmalloc(256 * sizeof(struct bridge *));
+      memset(b->child_index, 0, 256 * sizeof(struct bridge *));
+      for (c=b->child; c; c=c->prev)
+	if (c->domain == domain)
+	  {
+	    last = (c->subordinate < 255) ? c->subordinate : 255;
+	    for (i = c->secondary; i <= last; i++)
+	      if (!b->child_index[i])
+		b->child_index[i] = c;
+	  }
+    }
+  return b->child_index[n];
+}
+
 static struct bus *
 new_bus(struct bridge *b, unsigned int domain, unsigned int n)
 {
   struct bus *bus = xmalloc(sizeof(struct bus));
+  unsigned int h = bus_hash_of(domain, n);
   bus->domain = domain;
   bus->number = n;
   bus->sibling = NULL;
   bus->first_dev = NULL;
   bus->last_dev = &bus->first_dev;
   bus->parent_bridge = b;
+  bus->hash_next = bus_hash[h];
+  bus_hash[h] = bus;
   if (b->last_bus)
     b->last_bus->sibling = bus;
   b->last_bus = bus;
@@ -86,13 +169,12 @@ insert_dev(struct device *d, struct bridge *b)
 
   if (!bus && ! (bus = find_bus(b, p->domain, p->bus)))
     {
-      struct bridge *c;
-      for (c=b->child; c; c=c->prev)
-	if (c->domain == (unsigned)p->domain && c->secondary <= p->bus && p->bus <= c->subordinate)
-          {
-            insert_dev(d, c);
-            return;
-          }
+      struct bridge *c = find_child(b, p->domain, p->bus);
+      if (c)
+	{
+	  insert_dev(d, c);
+	  return;
+	}
       bus = new_bus(b, p->domain, p->bus);
     }
   /* Simple insertion at the end _does_ guarantee the correct order as the
@@ -109,17 +191,22 @@ void
 grow_tree(void)
 {
   struct device *d;
-  struct bridge **last_br, *b;
+  struct bridge **last_br, *b, *last_domain = NULL;
 
   last_br = &host_bridge.chain;
+  hash_devices();
 
   /* Build list of top level domain bridges */
 
   for (d=first_dev; d; d=d->next)
     {
+      /* Devices are sorted, so the domain is usually the same as for the previous one */
+      if (last_domain && last_domain->domain == (unsigned)d->dev->domain)
+        continue;
       for (b=host_bridge.chain; b; b=b->chain)
         if (b->domain == (unsigned)d->dev->domain)
           break;
+      last_domain = b;
       if (b)
         continue;
       b = xmalloc(sizeof(struct bridge));
@@ -131,10 +218,12 @@ grow_tree(void)
       last_br = &b->chain;
       b->prev = b->next = b->child = NULL;
       b->first_bus = NULL;
+      b->child_index = NULL;
       b->last_bus = NULL;
       b->br_dev = NULL;
       b->chain = NULL;
       pacc->debug("Tree: domain %04x\n", b->domain);
+      last_domain = b;
     }
 
   /* Build list of bridges */
@@ -164,6 +253,7 @@ grow_tree(void)
 	  last_br = &b->chain;
 	  b->prev = b->next = b->child = NULL;
 	  b->first_bus = NULL;
+	  b->child_index = NULL;
 	  b->last_bus = NULL;
 	  b->br_dev = d;
 	  d->bridge = b;
@@ -192,6 +282,7 @@ grow_tree(void)
       last_br = &b->chain;
       b->prev = b->next = b->child = NULL;
       b->first_bus = NULL;
+      b->child_index = NULL;
       b->last_bus = NULL;
       b->br_dev = parent;
       parent->bridge = b;
@@ -294,18 +385,17 @@ show_tree_dev(struct pci_filter *filter, struct device *d, char *line, char *p)
   char namebuf[256];
 
   p = tree_printf(line, p, "%02x.%x", q->dev, q->func);
-  for (b=host_bridge.chain; b; b=b->chain)
-    if (b->br_dev == d)
-      {
-	if (b->secondary == 0)
-	  p = tree_printf(line, p, "-");
-	else if (b->secondary == b->subordinate)
-	  p = tree_printf(line, p, "-[%02x]-", b->secondary);
-	else
-	  p = tree_printf(line, p, "-[%02x-%02x]-", b->secondary, b->subordinate);
-        show_tree_bridge(filter, b, line, p);
-        return;
-      }
+  if (b = d->bridge)
+    {
+      if (b->secondary == 0)
+	p = tree_printf(line, p, "-");
+      else if (b->secondary == b->subordinate)
+	p = tree_printf(line, p, "-[%02x]-", b->secondary);
+      else
+	p = tree_printf(line, p, "-[%02x-%02x]-", b->secondary, b->subordinate);
+      show_tree_bridge(filter, b, line, p);
+      return;
+    }
   if (verbose)
     p = tree_printf(line, p, "  %s",
 		    pci_lookup_name(pacc, namebuf, sizeof(namebuf),
@@ -341,14 +431,10 @@ check_dev_filter(struct pci_filter *filter, struct device *d)
   if (pci_filter_match(filter, d->dev))
     return 1;
 
-  for (br = host_bridge.chain; br; br = br->chain)
-    if (br->br_dev == d)
-      {
-        for (b = br->first_bus; b; b = b->sibling)
-          if (check_bus_filter(filter, b))
-            return 1;
-        break;
-      }
+  if (br = d->bridge)
+    for (b = br->first_bus; b; b = b->sibling)
+      if (check_bus_filter(filter, b))
+        return 1;
 
   return 0;
 }
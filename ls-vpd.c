@@ -12,6 +12,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lspci.h"
@@ -83,21 +84,27 @@ print_vpd_binary(const byte *buf, word len)
     }
 }
 
+static void
+sum_vpd(const byte *buf, int len, byte *csum)
+{
+  while (len--)
+    *csum += *buf++;
+}
+
 static int
 read_vpd(struct device *d, int pos, byte *buf, int len, byte *csum)
 {
   if (!pci_read_vpd(d->dev, pos, buf, len))
     return 0;
-  while (len--)
-    *csum += *buf++;
+  sum_vpd(buf, len, csum);
   return 1;
 }
 
 void
 cap_vpd(struct device *d)
 {
-  word res_addr = 0, res_len, part_pos, part_len;
-  byte buf[256];
+  word res_addr = 0, res_len, part_pos, part_len, data_len;
+  byte buf[3], *data;
   byte tag;
   byte csum = 0;
 
@@ -129,6 +136,23 @@ cap_vpd(struct device *d)
 
       part_pos = 0;
 
+      /*
+       *  VPD accesses are slow, so we fetch the whole resource at once
+       *  and parse it from memory. If it is not readable entirely,
+       *  we fall back to reading as many bytes as possible.
+       */
+      data = NULL;
+      data_len = 0;
+      if (tag == 0x82 || tag == 0x90 || tag == 0x91)
+	{
+	  data = xmalloc(res_len + 1);
+	  if (pci_read_vpd(d->dev, res_addr, data, res_len))
+	    data_len = res_len;
+	  else
+	    while (data_len < res_len && pci_read_vpd(d->dev, res_addr + data_len, data + data_len, 1))
+	      data_len++;
+	}
+
       switch (tag)
 	{
 	case 0x0f:
@@ -137,16 +161,8 @@ cap_vpd(struct device *d)
 
 	case 0x82:
 	  printf("\t\tProduct Name: ");
-	  while (part_pos < res_len)
-	    {
-	      part_len = res_len - part_pos;
-	      if (part_len > sizeof(buf))
-		part_len = sizeof(buf);
-	      if (!read_vpd(d, res_addr + part_pos, buf, part_len, &csum))
-		break;
-	      print_vpd_string(buf, part_len);
-	      part_pos += part_len;
-	    }
+	  sum_vpd(data, data_len, &csum);
+	  print_vpd_string(data, data_len);
 	  printf("\n");
 	  break;
 
@@ -155,19 +171,19 @@ cap_vpd(struct device *d)
 	  printf("\t\t%s fields:\n",
 		 (tag == 0x90) ? "Read-only" : "Read/write");
 
-	  while (part_pos + 3 <= res_len)
+	  while (part_pos + 3 <= data_len)
 	    {
 	      word read_len;
 	      const struct vpd_item *item;
 	      byte id[2], id1, id2;
+	      byte *field;
 
-	      if (!read_vpd(d, res_addr + part_pos, buf, 3, &csum))
-		break;
-	      part_pos += 3;
-	      memcpy(id, buf, 2);
+	      sum_vpd(data + part_pos, 3, &csum);
+	      memcpy(id, data + part_pos, 2);
 	      id1 = id[0];
 	      id2 = id[1];
-	      part_len = buf[2];
+	      part_len = data[part_pos + 2];
+	      part_pos += 3;
 	      if (part_len > res_len - part_pos)
 		break;
 
@@ -179,8 +195,10 @@ cap_vpd(struct device *d)
 	      /* Only read the first byte of the RV field because the
 	       * remaining bytes are not included in the checksum. */
 	      read_len = (item->format == F_RESVD) ? 1 : part_len;
-	      if (!read_vpd(d, res_addr + part_pos, buf, read_len, &csum))
+	      if (read_len > data_len - part_pos)
 		break;
+	      field = data + part_pos;
+	      sum_vpd(field, read_len, &csum);
 
 	      printf("\t\t\t[");
 	      print_vpd_string(id, 2);
@@ -189,11 +207,11 @@ cap_vpd(struct device *d)
 	      switch (item->format)
 	        {
 		case F_TEXT:
-		  print_vpd_string(buf, part_len);
+		  print_vpd_string(field, part_len);
 		  printf("\n");
 		  break;
 		case F_BINARY:
-		  print_vpd_binary(buf, part_len);
+		  print_vpd_binary(field, part_len);
 		  printf("\n");
 		  break;
 		case F_RESVD:
@@ -214,6 +232,7 @@ cap_vpd(struct device *d)
 	  return;
 	}
 
+      free(data);
       res_addr += res_len;
     }
 
@@ -29,11 +29,12 @@ static int opt_domains;			/* Show domain numbers (0=disabled, 1=auto-detected, 2
 static int opt_kernel;			/* Show kernel drivers */
 static int opt_query_dns;		/* Query the DNS (0=disabled, 1=enabled, 2=refresh cache) */
 static int opt_query_all;		/* Query the DNS for all entries */
+static int opt_write_index;		/* Write a binary index of the ID list and exit */
 char *opt_pcimap;			/* Override path to Linux modules.pcimap */
 
 const char program_name[] = "lspci";
 
-static char options[] = "nvbxs:d:tPi:mgp:qkMDQ" GENERIC_OPTIONS ;
+static char options[] = "nvbxs:d:tPi:Imgp:qkMDQ" GENERIC_OPTIONS ;
 
 static char help_msg[] =
 "Usage: lspci [<switches>]\n"
@@ -70,6 +71,7 @@ static char help_msg[] =
 "\n"
 "Other options:\n"
 "-i <file>\tUse specified ID database instead of %s\n"
+"-I\t\tWrite a binary index of the ID database and exit\n"
 #ifdef PCI_OS_LINUX
 "-p <file>\tLook up kernel modules in a given file instead of default modules.pcimap\n"
 #endif
@@ -86,6 +88,21 @@ struct device *first_dev;
 static int seen_errors;
 static int need_topology;
 
+static void
+config_grow(struct device *d, unsigned int end)
+{
+  if (end > d->config_bufsize)
+    {
+      int orig_size = d->config_bufsize;
+      while (end > d->config_bufsize)
+	d->config_bufsize *= 2;
+      d->config = xrealloc(d->config, d->config_bufsize);
+      d->present = xrealloc(d->present, d->config_bufsize);
+      memset(d->present + orig_size, 0, d->config_bufsize - orig_size);
+      pci_setup_cache(d->dev, d->config, d->dev->cache_len);
+    }
+}
+
 int
 config_fetch(struct device *d, unsigned int pos, unsigned int len)
 {
@@ -99,22 +116,36 @@ config_fetch(struct device *d, unsigned int pos, unsigned int len)
   if (!len)
     return 1;
 
-  if (end > d->config_bufsize)
-    {
-      int orig_size = d->config_bufsize;
-      while (end > d->config_bufsize)
-	d->config_bufsize *= 2;
-      d->config = xrealloc(d->config, d->config_bufsize);
-      d->present = xrealloc(d->present, d->config_bufsize);
-      memset(d->present + orig_size, 0, d->config_bufsize - orig_size);
-      pci_setup_cache(d->dev, d->config, d->dev->cache_len);
-    }
+  config_grow(d, end);
   result = pci_read_block(d->dev, pos, d->config + pos, len);
   if (result)
     memset(d->present + pos, 1, len);
   return result;
 }
 
+/* Let libpci read all capabilities in one block each and merge them to our copy of the config space */
+void
+config_fetch_caps(struct device *d)
+{
+  struct pci_cap *c;
+  unsigned int i;
+
+  if (d->no_config_access)
+    return;
+
+  for (c = pci_get_cap_table(d->dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS); c; c = c->next)
+    if (c->data)
+      {
+	config_grow(d, c->addr + c->len);
+	for (i = 0; i < c->len; i++)
+	  if (!d->present[c->addr + i])
+	    {
+	      d->config[c->addr + i] = c->data[i];
+	      d->present[c->addr + i] = 1;
+	    }
+      }
+}
+
 struct device *
 scan_device(struct pci_dev *p)
 {
@@ -157,6 +188,11 @@ scan_devices(void)
   struct pci_dev *p;
 
   pci_scan_bus(pacc);
+  if (!opt_filter)
+    {
+      /* We are going to read the same part of config space of all devices, so fetch it in one pass */
+      pci_prefetch_config(pacc, (opt_hex >= 4) ? 4096 : (opt_hex >= 3) ? 256 : 64);
+    }
   for (p=pacc->devices; p; p=p->next)
     if (d = scan_device(p))
       {
@@ -1104,6 +1140,48 @@ show(void)
       show_device(d);
 }
 
+/* Writing of the index of the ID list, without touching any devices */
+
+static void
+no_debug(char *msg UNUSED, ...)
+{
+}
+
+static int
+write_index(void)
+{
+  int ok;
+
+  /* pci_init() is not called, so it does not switch debugging messages off */
+  if (!pacc->debugging)
+    pacc->debug = no_debug;
+  ok = pci_write_name_index(pacc);
+  pci_cleanup(pacc);
+  return !ok;
+}
+
+/* Kinds of names we are going to look up, for pci_prefetch_names() */
+
+static int
+names_wanted(void)
+{
+  int what;
+
+  if (opt_tree)
+    return verbose ? PCI_LOOKUP_VENDOR | PCI_LOOKUP_DEVICE : 0;
+  what = PCI_LOOKUP_VENDOR | PCI_LOOKUP_DEVICE | PCI_LOOKUP_CLASS;
+  if (opt_machine)
+    what |= PCI_LOOKUP_SUBSYSTEM;
+  else
+    {
+      if (verbose)
+	what |= PCI_LOOKUP_PROGIF;
+      if (verbose || opt_kernel)
+	what |= PCI_LOOKUP_SUBSYSTEM;
+    }
+  return what;
+}
+
 /* Main */
 
 int
@@ -1158,6 +1236,9 @@ main(int argc, char **argv)
       case 'i':
         pci_set_name_list_path(pacc, optarg, 0);
 	break;
+      case 'I':
+	opt_write_index = 1;
+	break;
       case 'm':
 	opt_machine++;
 	break;
@@ -1197,6 +1278,9 @@ main(int argc, char **argv)
   if (optind < argc)
     goto bad;
 
+  if (opt_write_index)
+    return write_index();
+
   if (opt_query_dns)
     {
       pacc->id_lookup_mode |= PCI_LOOKUP_NETWORK;
@@ -1216,6 +1300,8 @@ main(int argc, char **argv)
   else
     {
       scan_devices();
+      if (pacc->id_lookup_mode & PCI_LOOKUP_NETWORK)
+	pci_prefetch_names(pacc, need_topology ? NULL : &gfilter, names_wanted());
       sort_them();
       if (need_topology)
 	grow_tree();
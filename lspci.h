@@ -54,6 +54,7 @@ struct device *scan_device(struct pci_dev *p);
 void show_device(struct device *d);
 
 int config_fetch(struct device *d, unsigned int pos, unsigned int len);
+void config_fetch_caps(struct device *d);
 u32 get_conf_long(struct device *d, unsigned int pos);
 word get_conf_word(struct device *d, unsigned int pos);
 byte get_conf_byte(struct device *d, unsigned int pos);
@@ -89,6 +90,7 @@ struct bridge {
   unsigned int domain;
   unsigned int primary, secondary, subordinate;	/* Bus numbers */
   struct device *br_dev;
+  struct bridge **child_index;		/* Child covering each bus number, built on demand */
 };
 
 struct bus {
@@ -97,6 +99,7 @@ struct bus {
   struct bus *sibling;
   struct bridge *parent_bridge;
   struct device *first_dev, **last_dev;
+  struct bus *hash_next;		/* Next bus in the same bucket of the bus hash */
 };
 
 extern struct bridge host_bridge;
@@ -49,6 +49,8 @@ struct pci_group {
   struct pci_filter filter;
   struct op *first_op;
   struct op **last_op;
+  struct pci_dev **devs;		/* Devices selected by match_groups() */
+  int num_devs, max_devs;
 };
 
 static struct pci_group *first_group, **last_group = &first_group;
@@ -62,38 +64,89 @@ matches_single_device(struct pci_group *group)
   return (f->domain >= 0 && f->bus >= 0 && f->slot >= 0 && f->func >= 0);
 }
 
+/*
+ *  Match all devices against filters of all groups in a single pass. Groups
+ *  selecting a single device are left to select_devices().
+ */
+static void
+match_groups(void)
+{
+  struct pci_group *group, **groups;
+  struct pci_filter **filters;
+  struct pci_filter_set *set;
+  struct pci_dev *dev;
+  int *result;
+  int cnt = 0, i, n;
+
+  for (group = first_group; group; group = group->next)
+    if (!matches_single_device(group))
+      cnt++;
+  if (!cnt)
+    return;
+  groups = xmalloc(sizeof(struct pci_group *) * cnt);
+  filters = xmalloc(sizeof(struct pci_filter *) * cnt);
+  result = xmalloc(sizeof(int) * cnt);
+  i = 0;
+  for (group = first_group; group; group = group->next)
+    if (!matches_single_device(group))
+      {
+	groups[i] = group;
+	filters[i++] = &group->filter;
+	group->max_devs = 1;
+	group->devs = xmalloc(sizeof(struct pci_dev *));
+      }
+
+  set = pci_filter_set_compile(pacc, filters, cnt);
+  for (dev = pacc->devices; dev; dev = dev->next)
+    {
+      n = pci_filter_set_match(set, dev, result);
+      for (i = 0; i < n; i++)
+	{
+	  group = groups[result[i]];
+	  if (group->num_devs + 1 >= group->max_devs)
+	    {
+	      group->max_devs *= 2;
+	      group->devs = xrealloc(group->devs, sizeof(struct pci_dev *) * group->max_devs);
+	    }
+	  group->devs[group->num_devs++] = dev;
+	}
+    }
+  pci_filter_set_free(set);
+
+  for (i = 0; i < cnt; i++)
+    groups[i]->devs[groups[i]->num_devs] = NULL;
+  free(result);
+  free(filters);
+  free(groups);
+}
+
 static struct pci_dev **
 select_devices(struct pci_group *group)
 {
   struct pci_filter *f = &group->filter;
 
-  if (!need_bus_scan && matches_single_device(group))
+  if (matches_single_device(group))
     {
       struct pci_dev **devs = xmalloc(sizeof(struct device *) * 2);
-      struct pci_dev *dev = pci_get_dev(pacc, f->domain, f->bus, f->slot, f->func);
+      struct pci_dev *dev;
       int i = 0;
-      if (pci_filter_match(f, dev))
+      if (need_bus_scan)
+	{
+	  for (dev = pacc->devices; dev; dev = dev->next)
+	    if (pci_filter_match(f, dev))
+	      break;
+	}
+      else
+	dev = pci_get_dev(pacc, f->domain, f->bus, f->slot, f->func);
+      if (dev && pci_filter_match(f, dev))
 	devs[i++] = dev;
       devs[i] = NULL;
       return devs;
     }
   else
     {
-      struct pci_dev **devs, *dev;
-      int i = 0;
-      int cnt = 1;
-
-      for (dev = pacc->devices; dev; dev = dev->next)
-	if (pci_filter_match(f, dev))
-	  cnt++;
-
-      devs = xmalloc(sizeof(struct device *) * cnt);
-
-      for (dev = pacc->devices; dev; dev = dev->next)
-	if (pci_filter_match(f, dev))
-	  devs[i++] = dev;
-
-      devs[i] = NULL;
+      struct pci_dev **devs = group->devs;
+      group->devs = NULL;
       return devs;
     }
 }
@@ -226,6 +279,9 @@ execute(void)
   struct pci_group *group;
   int group_cnt = 0;
 
+  if (need_bus_scan)
+    match_groups();
+
   for (group = first_group; group; group = group->next)
     {
       struct pci_dev **vec = select_devices(group);
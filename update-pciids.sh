@@ -5,9 +5,11 @@ set -e
 SRC="https://pci-ids.ucw.cz/v2.2/pci.ids"
 DEST=pci.ids
 PCI_COMPRESSED_IDS=
+PCI_IDS_INDEX=
 GREP=grep
 VERSION=unknown
 USER_AGENT=update-pciids/$VERSION
+LSPCI=lspci
 QUIET=
 
 [ "$1" = "-q" ] && quiet=true || quiet=false
@@ -94,4 +96,11 @@ if [ ${DEST%.gz} != ${DEST} ] ; then
 	rm -f ${DEST%.gz} ${DEST%.gz}.old
 fi
 
+# The binary index is tied to the old file, so build a new one. The list
+# itself is already installed, so a failure is not fatal.
+rm -f ${DEST%.gz}.idx
+if [ "$PCI_IDS_INDEX" = 1 ] && ! $LSPCI -i $DEST -I ; then
+	echo >&2 "update-pciids: warning: cannot build the index of the ID list"
+fi
+
 ${quiet} || echo "Done."